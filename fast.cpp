@@ -1,31 +1,51 @@
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <errno.h>
 #include <fcntl.h>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <new> // placement new
+#include <pthread.h> // pthread_atfork
+#include <queue>
+#include <random>
 #include <set>
+#include <stdexcept>
 #include <stdio.h>
+#include <string.h> // strcmp
 #include <string>
 #include <sys/mman.h>
+#include <sys/resource.h> // getrusage
 #include <sys/stat.h>
 #include <thread>
-#include <unistd.h> // ftruncate
+#include <unistd.h> // pwrite
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 #include <tuple>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE2 and AVX2 text scanning
+#endif
 
 /*
     Required to expose the functions.
     macro Boost.Python provides to signify a Python extension module
+    (left out when building only the command line tool, with
+    -DFASTBPE_NO_PYTHON)
 */
+#ifndef FASTBPE_NO_PYTHON
 #include <boost/python.hpp>
 
 // this will allow to pass objects between C++ and python
 namespace py = boost::python;
+#endif
 
 using namespace std;
 
@@ -42,7 +62,17 @@ struct pair_hash {
 
 using tp = pair<uint32_t, uint32_t>;
 using tps = pair<string, string>;
-using pc = unordered_map<tp, pair<int32_t, tp> *, pair_hash>;
+
+// orders (count, pair) entries so the highest count comes first and, on equal
+// counts, the lowest pair id wins
+struct pair_count_less {
+  bool operator()(const pair<int32_t, tp> &a,
+                  const pair<int32_t, tp> &b) const {
+    return a.first < b.first || (a.first == b.first && b.second < a.second);
+  }
+};
+using pairHeap =
+    priority_queue<pair<int32_t, tp>, vector<pair<int32_t, tp>>, pair_count_less>;
 
 using wCounts = vector<tuple<string, uint32_t>>;
 using wMapCounts = unordered_map<string, uint32_t>;
@@ -52,511 +82,2319 @@ using tripletVec = vector< triplet >;
 using codesMap = unordered_map<tps, uint32_t, pair_hash>;
 using reverseCodesMap = unordered_map<string, tps>;
 
-const size_t kMaxPairs = 1000 * 1000 * 1000;
-const size_t kThreads = max(1, min(10, int(thread::hardware_concurrency())));
 const char *kEndWord = "</w>";
 const size_t kEndWordLength = 4;
 const char *kTokenDelim = "@@";
 const size_t kTokenDelimLength = 2;
+const size_t kDefaultCacheSize = 1 << 16;
+// streaming applybpe has no vocabulary to encode once: a larger cache
+const size_t kStreamCacheSize = 1 << 18;
+const size_t kCacheShards = 16;
+// below this many items parallel loops run on the calling thread
+const size_t kDefaultInlineThreshold = 512;
+// first word of the binary files, to detect a foreign byte order
+const uint32_t kByteOrderMark = 0x01020304;
 
-void printUsage() {
-  cerr
-      << "usage: fastbpe <command> <args>\n\n"
-      << "The commands supported by fastBPE are:\n\n"
-      << "getvocab input1 [input2]             extract the vocabulary from one "
-         "or two text files\n"
-      << "learnbpe nCodes input1 [input2]      learn BPE codes from one or two "
-         "text files\n"
-      << "applybpe output input codes [vocab]  apply BPE codes to a text file\n"
-      << endl;
-}
+// ============================================================================
+// ============================== Thread pool =================================
+// ============================================================================
 
-void print_word_count(const wCounts &wc) {
-  fprintf(stderr, "\nWord Counts\n");
-  fprintf(stderr, "--------------\n");
-  for (wCounts::const_iterator i = wc.begin(); i != wc.end(); ++i) {
-        cout << get<0>(*i) << " " << get<1>(*i) << endl;
-  }
-  fprintf(stderr, "\n--------------\n");
-}
+/*
+    Process-wide pool of worker threads, started lazily on first use. Every
+    worker owns a deque of tasks: tasks are spread over them round-robin and
+    a worker that runs out of tasks steals from the others. Threads waiting
+    for a parallel loop to finish help running its tasks, so loops can be
+    nested.
 
-void print_word_map_count(const wMapCounts &wmc) {
-  fprintf(stderr, "\nWord Counts\n");
-  fprintf(stderr, "--------------\n");
-  for (auto x: wmc) {
-    cout << x.first << " " << x.second << endl;
+    The size defaults to the number of cores (or $PYBPE_NUM_THREADS) and can
+    be changed with setSize at any time: running loops and async tasks hold
+    the pool, and resizing waits for them to finish. A forked child starts
+    with a fresh, not yet started pool, as the parent's threads do not exist
+    there.
+*/
+class ThreadPool {
+public:
+  static ThreadPool &instance() {
+    static ThreadPool *pool = new ThreadPool();
+    return *pool;
   }
-  fprintf(stderr, "--------------\n");
-}
 
-void padText(string &text) {
-  int l = text.length();
-  if (text[l] != ' ' or text[l] != '\n') text.push_back('\n');
-}
+  size_t size() const { return num_threads; }
 
-int safeOpen(const char *file_path, int flags, mode_t mode = 0) {
-  int fd = open(file_path, flags, mode);
-  if (fd < 0) {
-    fprintf(stderr, "Cannot open text file %s\n", file_path);
-    exit(EXIT_FAILURE);
+  // waits for the running loops and async tasks, new ones wait for it
+  void setSize(size_t n) {
+    n = max<size_t>(1, n);
+    unique_lock<mutex> lock(users_mutex);
+    users_cv.wait(lock, [this]() { return users == 0; });
+    if (n == num_threads)
+      return;
+    stop();
+    num_threads = n;
   }
-  return fd;
-}
 
-void readText(const char *fp, wMapCounts &word_count) {
-  string cur_word;
-  uint64_t total = 0;
-  auto deal_with_char = [&](char cur_char){
-    if (cur_char == ' ' || cur_char == '\n') {
-      if (cur_word.size() == 0)
-        return;
-      // end of word
-      auto it = word_count.find(cur_word);
-      int count = it != word_count.end() ? it->second : 0;
-      word_count[cur_word] = count + 1;
-      total++;
-      cur_word.clear();
-    } else {
-      cur_word.push_back(cur_char);
+  size_t inlineThreshold() const { return inline_threshold; }
+  void setInlineThreshold(size_t n) { inline_threshold = n; }
+
+  /*
+      Calls fn(begin, end) over chunks of [0, n) of about `grain` items and
+      returns once all of them ran. Small loops (or a pool of one thread)
+      run inline on the calling thread.
+  */
+  void parallelFor(size_t n, size_t grain,
+                   const function<void(size_t, size_t)> &fn) {
+    if (n == 0)
+      return;
+    if (n <= inline_threshold || num_threads <= 1) {
+      fn(0, n);
+      return;
     }
-  };
+    grain = max(grain, n / (4 * num_threads) + 1);
+    size_t chunks = (n + grain - 1) / grain;
+    runTasks(chunks, [&](size_t c) {
+      fn(c * grain, min(n, (c + 1) * grain));
+    });
+  }
 
-  if (string(fp).compare("-") == 0) {
-    for (std::string line; std::getline(std::cin, line);) {
-      for(char c: line){
-        deal_with_char(c);
+  /*
+      Runs fn(0) ... fn(n - 1) as separate tasks and returns once all of
+      them ran. Meant for a few coarse tasks, so it ignores the inline
+      threshold.
+  */
+  void runTasks(size_t n, const function<void(size_t)> &fn) {
+    if (n == 1 || num_threads <= 1) {
+      for (size_t i = 0; i < n; i++) {
+        fn(i);
       }
-      deal_with_char('\n');
+      return;
+    }
+    struct Latch {
+      mutex m;
+      condition_variable cv;
+      size_t remaining;
+    } latch;
+    latch.remaining = n;
+    Use use(*this);
+    for (size_t i = 0; i < n; i++) {
+      submit([&fn, &latch, i]() {
+        fn(i);
+        lock_guard<mutex> lock(latch.m);
+        if (--latch.remaining == 0)
+          latch.cv.notify_all();
+      });
+    }
+    // help with the queued tasks, then wait for the running ones
+    State *st = state;
+    function<void()> task;
+    while (take(st, st->workers.size(), task)) {
+      task();
     }
+    unique_lock<mutex> lock(latch.m);
+    latch.cv.wait(lock, [&latch]() { return latch.remaining == 0; });
   }
-  else {
-    int fd = safeOpen(fp, O_RDONLY);
 
-    struct stat s;
-    int status = fstat(fd, &s);
-    fprintf(stderr, "Loading vocabulary from %s ...\n", fp);
+  /*
+      Queues `task` on the workers and returns at once: the caller tracks
+      its completion. A pool of one thread runs it inline.
+  */
+  void async(function<void()> task) {
+    if (num_threads <= 1) {
+      task();
+      return;
+    }
+    acquire();
+    submit([this, task]() {
+      task();
+      release();
+    });
+  }
 
-    auto size = s.st_size;
-    char *f = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+private:
+  // the pool is in use for as long as it lives, see setSize
+  class Use {
+  public:
+    explicit Use(ThreadPool &pool) : pool(pool) { pool.acquire(); }
+    ~Use() { pool.release(); }
 
-    for (size_t i = 0; i < size; i++) {
-      deal_with_char(f[i]);
-    }
+  private:
+    ThreadPool &pool;
+  };
+
+  void acquire() {
+    lock_guard<mutex> lock(users_mutex);
+    users++;
   }
-  fprintf(stderr, "Read %lu words (%lu unique) from text file.\n", total,
-          word_count.size());
-}
 
-void readString(const string &text, wMapCounts &word_count) {
-  string cur_word;
-  uint64_t total = 0;
-  auto deal_with_char = [&](char cur_char){
-    if (cur_char == ' ' || cur_char == '\n') {
-      if (cur_word.size() == 0)
-        return;
-      // end of word
-      auto it = word_count.find(cur_word);
-      int count = it != word_count.end() ? it->second : 0;
-      word_count[cur_word] = count + 1;
-      total++;
-      cur_word.clear();
-    } else {
-      cur_word.push_back(cur_char);
-    }
+  void release() {
+    lock_guard<mutex> lock(users_mutex);
+    if (--users == 0)
+      users_cv.notify_all();
+  }
+
+  struct Queue {
+    mutex m;
+    deque<function<void()>> tasks;
+  };
+
+  struct State {
+    vector<thread> workers;
+    vector<unique_ptr<Queue>> queues;
+    mutex m;
+    condition_variable cv;
+    atomic<size_t> pending{0};
+    atomic<size_t> next_queue{0};
+    bool stopping = false;
   };
 
-  for (int i = 0; i < text.length() ; i++) {
-    deal_with_char(text[i]);
+  ThreadPool() {
+    const char *env = getenv("PYBPE_NUM_THREADS");
+    size_t n = env != nullptr ? atoi(env) : thread::hardware_concurrency();
+    num_threads = max<size_t>(1, n);
+    // no other thread holds the pool locks across a fork, so that the
+    // child, where only the forking thread survives, can take them
+    pthread_atfork(
+        []() {
+          instance().users_mutex.lock();
+          instance().start_mutex.lock();
+        },
+        []() {
+          instance().start_mutex.unlock();
+          instance().users_mutex.unlock();
+        },
+        []() {
+          auto &pool = instance();
+          // leak the parent's state, and its waiters on users_cv
+          pool.state = nullptr;
+          pool.users = 0;
+          new (&pool.users_cv) condition_variable();
+          pool.start_mutex.unlock();
+          pool.users_mutex.unlock();
+        });
   }
 
-  fprintf(stderr, "Read %lu words (%lu unique) from string.\n", total,
-          word_count.size());
-}
+  void start() {
+    lock_guard<mutex> lock(start_mutex);
+    if (state != nullptr)
+      return;
+    State *st = new State();
+    for (size_t i = 0; i < num_threads; i++) {
+      st->queues.emplace_back(new Queue());
+    }
+    for (size_t i = 0; i < num_threads; i++) {
+      st->workers.emplace_back([this, st, i]() { work(st, i); });
+    }
+    state = st;
+  }
 
-std::pair<size_t, uint64_t> output_or_count(
-  unordered_map<string, string> &bpe, size_t size, char *f, char *fo
-) {
-  string cur_word;
-  size_t charOut = 0;
-  uint64_t total = 0;
-  for (size_t i = 0; i < size; i++) {
-    auto &cur_char = f[i];
-    if (cur_char == ' ' || cur_char == '\n') {
-      if (cur_word.size() == 0) {
-        if (fo != nullptr) fo[charOut] = cur_char;
-        charOut++;
-        continue;
-      }
-      // end of word : write bpe to output
-      auto it = bpe.find(cur_word);
-      assert(it != bpe.end());
-      for (auto x : it->second) {
-        if (fo != nullptr) fo[charOut] = x;
-        charOut++;
-      }
-      if (fo != nullptr) fo[charOut] = cur_char;
-      charOut++;
+  void stop() {
+    lock_guard<mutex> lock(start_mutex);
+    State *st = state;
+    if (st == nullptr)
+      return;
+    {
+      lock_guard<mutex> lock(st->m);
+      st->stopping = true;
+    }
+    st->cv.notify_all();
+    for (auto &t : st->workers) {
+      t.join();
+    }
+    state = nullptr;
+    delete st;
+  }
 
-      total++;
-      cur_word.clear();
-    } else {
-      cur_word.push_back(cur_char);
+  void submit(function<void()> task) {
+    if (state == nullptr)
+      start();
+    State *st = state;
+    size_t q = st->next_queue++ % st->queues.size();
+    {
+      lock_guard<mutex> lock(st->m);
+      st->pending++;
+    }
+    {
+      lock_guard<mutex> lock(st->queues[q]->m);
+      st->queues[q]->tasks.push_back(move(task));
     }
+    st->cv.notify_one();
   }
-  return std::make_pair(charOut, total);
-}
 
-string outputString(const string &text, unordered_map<string, string> &bpe) {
-  string outputStr = "";
-  string cur_word;
-  size_t charOut = 0;
-  uint64_t total = 0;
-  for (size_t i = 0; i < text.length(); i++) {
-    auto &cur_char = text[i];
-    if (cur_char == ' ' || cur_char == '\n') {
-      // we reached a word boundary
-      if (cur_word.size() == 0) {
-        outputStr.push_back(cur_char);
-        charOut++;
+  // pops a task from queue `self` (front) or steals one from another (back)
+  bool take(State *st, size_t self, function<void()> &task) {
+    size_t n = st->queues.size();
+    for (size_t k = 0; k < n; k++) {
+      size_t q = (self + k) % n;
+      auto &queue = *st->queues[q];
+      lock_guard<mutex> lock(queue.m);
+      if (queue.tasks.empty())
         continue;
+      if (q == self) {
+        task = move(queue.tasks.front());
+        queue.tasks.pop_front();
+      } else {
+        task = move(queue.tasks.back());
+        queue.tasks.pop_back();
       }
-      // end of word : write bpe to output
-      auto it = bpe.find(cur_word);
-      assert(it != bpe.end());
-      for (auto x : it->second) {
-        outputStr.push_back(x);
-        charOut++;
-      }
-      outputStr.push_back(cur_char);
-      charOut++;
+      st->pending--;
+      return true;
+    }
+    return false;
+  }
 
-      total++;
-      cur_word.clear();
-    } else {
-      // append the current character as part of the current word
-      cur_word.push_back(cur_char);
+  void work(State *st, size_t self) {
+    while (true) {
+      function<void()> task;
+      if (take(st, self, task)) {
+        task();
+        continue;
+      }
+      unique_lock<mutex> lock(st->m);
+      st->cv.wait(lock, [st]() { return st->stopping || st->pending > 0; });
+      if (st->stopping)
+        return;
     }
   }
-  return outputStr;
-}
 
-void outputText(const char *fpo, const char *fp,
-                unordered_map<string, string> &bpe) {
+  atomic<State *> state{nullptr};
+  mutex start_mutex;
+  // loops and async tasks running, setSize holds users_mutex while resizing
+  mutex users_mutex;
+  condition_variable users_cv;
+  size_t users = 0;
+  atomic<size_t> num_threads{1};
+  atomic<size_t> inline_threshold{kDefaultInlineThreshold};
+};
 
-  int fd = safeOpen(fp, O_RDONLY);
-  auto fdOut = safeOpen(fpo, O_RDWR | O_CREAT | O_TRUNC, 0666);
+// ============================================================================
+// ================================== Stats ===================================
+// ============================================================================
 
-  struct stat s;
-  int status = fstat(fd, &s);
+/*
+    Process-wide counters and timers of the encoder and the learner. They
+    cost a branch when disabled (the default, unless $PYBPE_STATS is set)
+    and are compiled out altogether with -DFASTBPE_NO_STATS.
+*/
+class Stats {
+public:
+  enum Counter {
+    kWords,             // words encoded
+    kDistinctWords,     // distinct words looked up, summed over batches
+    kBytesIn,           // text encoded
+    kBytesOut,          // BPE written
+    kCacheHits,
+    kCacheMisses,
+    kEncodedWords,      // words segmented, i.e. cache misses
+    kMerges,            // merges done by the segmented words
+    kBpeNs,             // time applying the merges to words
+    kLimitVocabNs,      // time restricting their tokens to the vocabulary
+    kCountedWords,      // words counted by getvocab and learnbpe
+    kLearnMerges,
+    kLearnNs,           // time merging, without counting the words
+    kPeakDistinctWords, // largest batch of distinct words
+    kPeakPairs,         // largest pair table of the learner
+    kPeakMemoryKB,      // peak resident memory when learning ended
+    kNumCounters
+  };
 
-  fprintf(stderr, "Applying BPE to %s ...\n", fp);
-  auto size = s.st_size;
-  char *f = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  static Stats &instance() {
+    static Stats *stats = new Stats();
+    return *stats;
+  }
 
-  auto p = output_or_count(bpe, size, f, nullptr);
-  size_t out_size = p.first;
+  bool enabled() const { return on.load(memory_order_relaxed); }
+  void setEnabled(bool enabled) { on.store(enabled); }
 
-  if (ftruncate(fdOut, out_size) < 0) {
-    fprintf(stderr, "Couldn't truncate output file %s to size %lu\n", fpo,
-            out_size);
-    exit(EXIT_FAILURE);
+  void add(Counter c, uint64_t v) {
+    counters[c].fetch_add(v, memory_order_relaxed);
   }
-
-  char *fo = (char *)mmap(NULL, out_size, PROT_WRITE, MAP_SHARED, fdOut, 0);
-  if (fo == MAP_FAILED) {
-    fprintf(stderr, "Output memory map failed : %d.\n", errno);
-    exit(EXIT_FAILURE);
+  void setMax(Counter c, uint64_t v) {
+    uint64_t cur = counters[c].load(memory_order_relaxed);
+    while (cur < v && !counters[c].compare_exchange_weak(cur, v))
+      ;
+  }
+  uint64_t get(Counter c) const { return counters[c].load(); }
+  static const char *name(Counter c) {
+    static const char *names[kNumCounters] = {
+        "words",          "distinct_words",      "bytes_in",
+        "bytes_out",      "cache_hits",          "cache_misses",
+        "encoded_words",  "merges",              "bpe_ns",
+        "limit_vocab_ns", "counted_words",       "learn_merges",
+        "learn_ns",       "peak_distinct_words", "peak_pairs",
+        "peak_memory_kb"};
+    return names[c];
   }
-  p = output_or_count(bpe, size, f, fo);
-  fprintf(stderr, "Modified %lu words from text file.\n", p.second);
-  munmap(fo, out_size);
-  munmap(f, size);
-  close(fdOut);
-  close(fd);
-}
-
-void tokenize(const wMapCounts &word_count,
-              wMapCounts &token_to_int,
-              vector<string> &int_to_token, vector<list<uint32_t>> &words,
-              vector<int32_t> &counts) {
 
-  for (auto &x : word_count) {
-    auto &word = x.first;
+  // time of a learnbpe merge (already in kLearnNs), and the size of the
+  // pair table after it
+  void addLearnIteration(uint64_t ns, uint64_t pairs) {
+    add(kLearnMerges, 1);
+    setMax(kPeakPairs, pairs);
+    lock_guard<mutex> lock(m);
+    learn_merge_ns.push_back(ns);
+    learn_pairs.push_back(pairs);
+  }
+  void learnIterations(vector<uint64_t> &merge_ns,
+                       vector<uint64_t> &pairs) const {
+    lock_guard<mutex> lock(m);
+    merge_ns = learn_merge_ns;
+    pairs = learn_pairs;
+  }
 
-    words.push_back(list<uint32_t>());
-    auto &current_word = words.back();
-    counts.push_back(x.second);
+  void reset() {
+    for (auto &c : counters)
+      c.store(0);
+    lock_guard<mutex> lock(m);
+    learn_merge_ns.clear();
+    learn_pairs.clear();
+  }
 
-    int pos = 0, realLength = 0;
-    int lastStart = 0;
-    while (word[pos]) {
-      bool newChar = (word[pos] & 0xc0) != 0x80; // not a continuation byte
-      realLength += newChar;
-      // new token
-      if (newChar && pos > 0) {
-        auto new_token = word.substr(lastStart, pos - lastStart);
-        if (token_to_int.count(new_token) == 0) {
-          int_to_token.push_back(new_token);
-          token_to_int[new_token] = int_to_token.size() - 1;
-        }
-        current_word.push_back(token_to_int[new_token]);
-        lastStart = pos;
-      }
-      pos++;
-    }
-    auto new_token = word.substr(lastStart, string::npos) + kEndWord;
-    if (token_to_int.count(new_token) == 0) {
-      int_to_token.push_back(new_token);
-      token_to_int[new_token] = int_to_token.size() - 1;
+  // counters, then the learner iterations as arrays
+  string json() const {
+    string out = "{";
+    char buf[64];
+    for (int c = 0; c < kNumCounters; c++) {
+      snprintf(buf, sizeof(buf), "\"%s\": %lu, ", name(Counter(c)),
+               get(Counter(c)));
+      out += buf;
     }
-    current_word.push_back(token_to_int[new_token]);
+    vector<uint64_t> merge_ns, pairs;
+    learnIterations(merge_ns, pairs);
+    auto array = [&](const char *key, const vector<uint64_t> &values) {
+      out += string("\"") + key + "\": [";
+      for (size_t i = 0; i < values.size(); i++) {
+        snprintf(buf, sizeof(buf), i > 0 ? ", %lu" : "%lu", values[i]);
+        out += buf;
+      }
+      out += "]";
+    };
+    array("learn_merge_ns", merge_ns);
+    out += ", ";
+    array("learn_pairs", pairs);
+    return out + "}";
   }
-}
-
-void tokenize_str(const wMapCounts &word_count,
-                  unordered_map<string, vector<string>> &words) {
 
-  for (auto &x : word_count) {
-    auto &word = x.first;
-    words[word] = vector<string>();
-
-    int pos = 0, realLength = 0;
-    int lastStart = 0;
-    while (word[pos]) {
-      bool newChar = (word[pos] & 0xc0) != 0x80; // not a continuation byte
-      realLength += newChar;
-      // new token
-      if (newChar && pos > 0) {
-        auto new_token = word.substr(lastStart, pos - lastStart);
-        words[word].push_back(new_token);
-        lastStart = pos;
-      }
-      pos++;
-    }
-    auto new_token = word.substr(lastStart, string::npos) + kEndWord;
-    words[word].push_back(new_token);
+private:
+  Stats() {
+    const char *env = getenv("PYBPE_STATS");
+    on = env != nullptr && atoi(env) != 0;
+    reset();
   }
-}
 
+  atomic<bool> on{false};
+  atomic<uint64_t> counters[kNumCounters];
+  mutable mutex m;
+  vector<uint64_t> learn_merge_ns, learn_pairs;
+};
 
-void count_in_word(
-    list<uint32_t> &word, uint32_t wi, uint32_t count, pc &pair_counts,
-    vector<pair<int32_t, tp>> &contiguous_counts,
-    unordered_map<tp, unordered_set<uint32_t>, pair_hash> &where) {
-  bool second = false;
-  tp cur_pair;
-  for (uint32_t token : word) {
-    if (second) {
-      cur_pair.first = cur_pair.second;
-    }
-    cur_pair.second = token;
-    if (second) {
-      auto it = pair_counts.find(cur_pair);
-      if (it == pair_counts.end()) {
-        contiguous_counts.emplace_back(0, cur_pair);
-        auto *added = &contiguous_counts.back();
-        pair_counts.emplace(piecewise_construct, forward_as_tuple(cur_pair),
-                            forward_as_tuple(added));
-        where[cur_pair].emplace();
-      }
-      if (count > 0) {
-        where[cur_pair].insert(wi);
-      } else {
-        where[cur_pair].erase(wi);
-      }
-      pair_counts[cur_pair]->first += count;
-    } else {
-      second = true;
-    }
+// writes the stats as JSON to `fp`, stderr if "-"
+void dumpStats(const char *fp) {
+  string json = Stats::instance().json() + "\n";
+  if (string(fp) == "-") {
+    fputs(json.c_str(), stderr);
+    return;
+  }
+  ofstream file(fp);
+  if (!(file << json)) {
+    fprintf(stderr, "Cannot write stats to %s\n", fp);
+    exit(EXIT_FAILURE);
   }
 }
 
-void find_maxp(vector<pair<int32_t, tp>> &contiguous_counts, tp &maxp,
-               uint32_t &max_c) {
-  max_c = 0;
-  for (auto &x : contiguous_counts) {
-    if (x.first > max_c) {
-      max_c = x.first;
-      maxp = x.second;
-    } else if (x.first == max_c and x.second < maxp) {
-      maxp = x.second;
-    }
+#ifdef FASTBPE_NO_STATS
+inline bool statsOn() { return false; }
+#else
+inline bool statsOn() { return Stats::instance().enabled(); }
+#endif
+
+// adds the time of its scope to a counter, if stats are on
+class StatTimer {
+public:
+  explicit StatTimer(Stats::Counter c) : counter(c), on(statsOn()) {
+    if (on)
+      start = chrono::steady_clock::now();
   }
-}
+  ~StatTimer() { stop(); }
 
-void getvocab(const char *inputFile1, const char *inputFile2) {
-  // get vocab
-  wMapCounts word_count;
-  readText(inputFile1, word_count);
-  if (inputFile2 != "") {
-    readText(inputFile2, word_count);
+  // adds the time so far, returns it in ns
+  uint64_t stop() {
+    if (!on)
+      return 0;
+    on = false;
+    uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(
+                      chrono::steady_clock::now() - start)
+                      .count();
+    Stats::instance().add(counter, ns);
+    return ns;
   }
 
-  // sort vocab
-  auto compFunctor = [](pair<string, int> elem1, pair<string, int> elem2) {
-    return elem1.second > elem2.second ||
-           (elem1.second == elem2.second && elem1.first < elem2.first);
-  };
-  set<pair<string, int>, decltype(compFunctor)> sorted_vocab(
-      word_count.begin(), word_count.end(), compFunctor);
-  assert(word_count.size() == sorted_vocab.size());
+private:
+  Stats::Counter counter;
+  bool on;
+  chrono::steady_clock::time_point start;
+};
 
-  // // print sorted vocab
-  // for (auto element : sorted_vocab)
-  //   cout << element.first << " " << element.second << endl;
+// ============================================================================
+// ============================ Flat hash tables ==============================
+// ============================================================================
+
+// splitmix64 finalizer, mixes every bit of both ids of a packed pair
+uint64_t hashKey(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
 }
 
+// hashes 8 bytes at a time, most words take a single round
+uint64_t hashBytes(const char *p, size_t n) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ n;
+  for (; n >= 8; p += 8, n -= 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    h = hashKey(h ^ w);
+  }
+  uint64_t w = 0;
+  memcpy(&w, p, n);
+  return hashKey(h ^ w);
+}
 
-wMapCounts getvocabs(string &text) {
-  // append space char at the end to
-  padText(text);
-  // get vocab
-  wMapCounts word_count;
-  readString(text, word_count);
-  return word_count;
+// a pair of token ids as a single 64 bits key
+uint64_t pairKey(const tp &pair) {
+  return uint64_t(pair.first) << 32 | pair.second;
 }
 
-tripletVec _learnbpe(const uint32_t kNPairs, const wMapCounts &word_count, bool print = false){
-  // a token is an int, it represents a string
-  wMapCounts token_to_int;
-  vector<string> int_to_token;
+// string key not owning its bytes
+struct StrView {
+  const char *p;
+  size_t n;
+};
 
-  vector<list<uint32_t>> words;
-  vector<int32_t> counts;
+// hashing and empty slot marker of the keys of a FlatMap
+template <class K> struct FlatKey;
 
-  tokenize(word_count, token_to_int, int_to_token, words, counts);
+template <> struct FlatKey<uint64_t> {
+  // pairKey of (UINT32_MAX, UINT32_MAX), never a pair of token ids
+  static uint64_t empty() { return UINT64_MAX; }
+  static bool isEmpty(uint64_t k) { return k == UINT64_MAX; }
+  static uint64_t hash(uint64_t k) { return hashKey(k); }
+  static bool equal(uint64_t a, uint64_t b) { return a == b; }
+};
 
-  vector<pair<int32_t, tp>> contiguous_counts;
-  contiguous_counts.reserve(kMaxPairs);
+template <> struct FlatKey<StrView> {
+  static StrView empty() { return {nullptr, 0}; }
+  static bool isEmpty(const StrView &k) { return k.p == nullptr; }
+  static uint64_t hash(const StrView &k) { return hashBytes(k.p, k.n); }
+  static bool equal(const StrView &a, const StrView &b) {
+    return a.n == b.n && memcmp(a.p, b.p, a.n) == 0;
+  }
+};
 
-  pc pair_counts;
-  unordered_map<tp, unordered_set<uint32_t>, pair_hash> where_to_update;
+/*
+    Hash table with linear probing over flat key and value arrays: no
+    allocation per entry, and a lookup is one hash and a few adjacent
+    compares. Erasing shifts the following entries back, so there are no
+    tombstones. Pointers to values are invalidated by insertions and
+    erasures.
+*/
+template <class K, class V> class FlatMap {
+public:
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
 
-  tp cur_pair;
-  uint32_t max_c = 0;
-  tp max_p;
-  for (uint32_t wi = 0; wi < words.size(); wi++) {
-    count_in_word(words[wi], wi, counts[wi], pair_counts,
-                  contiguous_counts, where_to_update);
+  V *find(const K &key) {
+    if (count == 0)
+      return nullptr;
+    size_t i = slotOf(key);
+    return FlatKey<K>::isEmpty(keys[i]) ? nullptr : &values[i];
+  }
+  const V *find(const K &key) const {
+    return const_cast<FlatMap *>(this)->find(key);
   }
-  find_maxp(contiguous_counts, max_p, max_c);
-
-  tripletVec codes;
-  for (int i = 0; i < kNPairs; i++) {
-    // create new token for pair. replace
-    auto new_token = int_to_token[max_p.first] + int_to_token[max_p.second];
 
-    codes.push_back(triplet(int_to_token[max_p.first], int_to_token[max_p.second], max_c));
+  // value of `key`, inserted as `value` if missing; second is true then
+  pair<V *, bool> insert(const K &key, const V &value = V()) {
+    if (2 * (count + 1) > keys.size())
+      rehash(max<size_t>(16, 2 * keys.size()));
+    size_t i = slotOf(key);
+    if (!FlatKey<K>::isEmpty(keys[i]))
+      return make_pair(&values[i], false);
+    keys[i] = key;
+    values[i] = value;
+    count++;
+    return make_pair(&values[i], true);
+  }
 
-    if (print)
-      cout << int_to_token[max_p.first] << " " << int_to_token[max_p.second]
-           << " " << max_c << endl;
+  V &operator[](const K &key) { return *insert(key).first; }
 
-    uint32_t new_token_id = int_to_token.size();
-    int_to_token.push_back(new_token);
-    token_to_int[new_token] = new_token_id;
-    max_c = 0;
-    auto change_count = [&](tp pair, int32_t v, uint32_t wi) {
-      auto it = pair_counts.find(pair);
-      if (it != pair_counts.end()) {
-        // assert(it->second + v >= 0);
-        it->second->first += v;
-      } else {
-        if (v > 0) {
-          contiguous_counts.emplace_back(v, pair);
-          pair_counts.emplace(piecewise_construct, forward_as_tuple(pair),
-                              forward_as_tuple(&(contiguous_counts.back())));
-          where_to_update[pair] = unordered_set<uint32_t>();
-        }
+  bool erase(const K &key) {
+    if (count == 0)
+      return false;
+    size_t mask = keys.size() - 1;
+    size_t i = slotOf(key);
+    if (FlatKey<K>::isEmpty(keys[i]))
+      return false;
+    // move back the entries that probed past the erased one
+    for (size_t j = (i + 1) & mask; !FlatKey<K>::isEmpty(keys[j]);
+         j = (j + 1) & mask) {
+      size_t home = FlatKey<K>::hash(keys[j]) & mask;
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+        keys[i] = keys[j];
+        values[i] = move(values[j]);
+        i = j;
       }
-      if (v > 0)
-        where_to_update[pair].insert(wi);
-    };
+    }
+    keys[i] = FlatKey<K>::empty();
+    values[i] = V();
+    count--;
+    return true;
+  }
 
-    for (auto wi : where_to_update[max_p]) {
-      auto &cur_word = words[wi];
-      auto it = cur_word.begin();
-      bool second = false;
-      while (it != cur_word.end()) {
-        if (second) {
-          cur_pair.first = cur_pair.second;
-        }
-        cur_pair.second = *it;
-
-        if (second) {
-          // found the pair
-          if (cur_pair == max_p) {
-            it--; // points to first element of pair
-            // if there is a token before us
-            if (it != cur_word.begin()) {
-              it--;
-              change_count(make_pair(*it, cur_pair.first), -counts[wi], wi);
-              change_count(make_pair(*it, new_token_id), counts[wi], wi);
-              it++;
-            }
-
-            it = cur_word.insert(it, new_token_id); // it points to new token
-            it++;                    // it points to first element of pair
-            it = cur_word.erase(it); // it points to second element of pair
-            it = cur_word.erase(it); // it points to next value
-
-            // if there is a token after the one we inserted
-            if (it != cur_word.end()) {
-              change_count(make_pair(cur_pair.second, *it), -counts[wi], wi);
-              change_count(make_pair(new_token_id, *it), counts[wi], wi);
-            }
-            cur_pair.second = new_token_id;
-          } else {
-            it++;
-          }
-        } else {
-          second = true;
-          it++;
-        }
-      }
+  void reserve(size_t n) {
+    size_t slots = 16;
+    while (slots < 2 * n)
+      slots <<= 1;
+    if (slots > keys.size())
+      rehash(slots);
+  }
+
+  void clear() {
+    keys.clear();
+    values.clear();
+    count = 0;
+  }
+
+  // calls f(key, value) on every entry, in table order
+  template <class F> void forEach(F f) const {
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (!FlatKey<K>::isEmpty(keys[i]))
+        f(keys[i], values[i]);
     }
+  }
+
+private:
+  // slot holding `key`, or the empty slot where it would go
+  size_t slotOf(const K &key) const {
+    size_t mask = keys.size() - 1;
+    size_t i = FlatKey<K>::hash(key) & mask;
+    while (!FlatKey<K>::isEmpty(keys[i]) && !FlatKey<K>::equal(keys[i], key))
+      i = (i + 1) & mask;
+    return i;
+  }
 
-    if (pair_counts.find(max_p) != pair_counts.end()){
-      pair_counts[max_p]->first = 0;
+  void rehash(size_t slots) {
+    vector<K> old_keys(slots, FlatKey<K>::empty());
+    vector<V> old_values(slots);
+    old_keys.swap(keys);
+    old_values.swap(values);
+    for (size_t i = 0; i < old_keys.size(); i++) {
+      if (FlatKey<K>::isEmpty(old_keys[i]))
+        continue;
+      size_t j = slotOf(old_keys[i]);
+      keys[j] = old_keys[i];
+      values[j] = move(old_values[i]);
     }
-    find_maxp(contiguous_counts, max_p, max_c);
   }
-  return codes;
-}
 
-void learnbpe(const uint32_t kNPairs, const char *inputFile1,
-              const char *inputFile2) {
-  // get vocab
-  wMapCounts word_count;
-  readText(inputFile1, word_count);
-  if (inputFile2 != "") {
-    readText(inputFile2, word_count);
+  vector<K> keys;
+  vector<V> values;
+  size_t count = 0;
+};
+
+// ============================================================================
+// ============================== Text scanning ===============================
+// ============================================================================
+
+/*
+    Word boundaries (' ' and '\n') and UTF-8 character starts (bytes that
+    are not 10xxxxxx continuation bytes) are found 64 bytes at a time, as
+    bit masks whose bit i is set for byte i. The kernels use SSE2 or AVX2
+    when the CPU has them, as detected at run time, or plain C++. The
+    PYBPE_SIMD environment variable (scalar, sse2 or avx2) forces one.
+*/
+const size_t kScanBlock = 64;
+
+struct ScanKernels {
+  const char *name;
+  uint64_t (*separators)(const char *p);
+  uint64_t (*charStarts)(const char *p);
+};
+
+uint64_t separatorsScalar(const char *p) {
+  uint64_t mask = 0;
+  for (size_t i = 0; i < kScanBlock; i++) {
+    mask |= uint64_t(p[i] == ' ' || p[i] == '\n') << i;
   }
-  _learnbpe(kNPairs, word_count, true);
+  return mask;
 }
 
-tripletVec learnbpes(const uint32_t kNPairs, string &text) {
-  wMapCounts word_count = getvocabs(text);
-  tripletVec codes = _learnbpe(kNPairs, word_count);
-  return codes;
+uint64_t charStartsScalar(const char *p) {
+  uint64_t mask = 0;
+  for (size_t i = 0; i < kScanBlock; i++) {
+    mask |= uint64_t((p[i] & 0xc0) != 0x80) << i;
+  }
+  return mask;
 }
 
-void split(vector<string> &splits, const string &text, char sep) {
-  size_t start = 0, end = 0;
-  while ((end = text.find(sep, start)) != string::npos) {
-    if (end != start)
-      splits.push_back(text.substr(start, end - start));
-    start = end + 1;
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) uint64_t separatorsSse2(const char *p) {
+  const __m128i space = _mm_set1_epi8(' '), newline = _mm_set1_epi8('\n');
+  uint64_t mask = 0;
+  for (size_t k = 0; k < kScanBlock; k += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + k));
+    __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+                              _mm_cmpeq_epi8(v, newline));
+    mask |= uint64_t(uint32_t(_mm_movemask_epi8(eq))) << k;
   }
-  if (end != start && start < text.size())
-    splits.push_back(text.substr(start));
+  return mask;
 }
 
-void readVocab(const char *fp, wMapCounts &vocab) {
-  ifstream file(fp);
-  if (!file) {
-    fprintf(stderr, "Cannot open vocabulary file %s\n", fp);
-    exit(EXIT_FAILURE);
+// continuation bytes are the signed chars in [-128, -65]
+__attribute__((target("sse2"))) uint64_t charStartsSse2(const char *p) {
+  const __m128i last_continuation = _mm_set1_epi8(-65);
+  uint64_t mask = 0;
+  for (size_t k = 0; k < kScanBlock; k += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + k));
+    __m128i start = _mm_cmpgt_epi8(v, last_continuation);
+    mask |= uint64_t(uint32_t(_mm_movemask_epi8(start))) << k;
+  }
+  return mask;
+}
+
+__attribute__((target("avx2"))) uint64_t separatorsAvx2(const char *p) {
+  const __m256i space = _mm256_set1_epi8(' '), newline = _mm256_set1_epi8('\n');
+  uint64_t mask = 0;
+  for (size_t k = 0; k < kScanBlock; k += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + k));
+    __m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+                                 _mm256_cmpeq_epi8(v, newline));
+    mask |= uint64_t(uint32_t(_mm256_movemask_epi8(eq))) << k;
+  }
+  return mask;
+}
+
+__attribute__((target("avx2"))) uint64_t charStartsAvx2(const char *p) {
+  const __m256i last_continuation = _mm256_set1_epi8(-65);
+  uint64_t mask = 0;
+  for (size_t k = 0; k < kScanBlock; k += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + k));
+    __m256i start = _mm256_cmpgt_epi8(v, last_continuation);
+    mask |= uint64_t(uint32_t(_mm256_movemask_epi8(start))) << k;
+  }
+  return mask;
+}
+#endif
+
+// kernels the CPU can run, the fastest last
+vector<ScanKernels> supportedScanKernels() {
+  vector<ScanKernels> kernels;
+  kernels.push_back({"scalar", separatorsScalar, charStartsScalar});
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    kernels.push_back({"sse2", separatorsSse2, charStartsSse2});
+  if (__builtin_cpu_supports("avx2"))
+    kernels.push_back({"avx2", separatorsAvx2, charStartsAvx2});
+#endif
+  return kernels;
+}
+
+ScanKernels selectScanKernels() {
+  auto kernels = supportedScanKernels();
+  const char *forced = getenv("PYBPE_SIMD");
+  for (auto &k : kernels) {
+    if (forced != nullptr && strcmp(forced, k.name) == 0)
+      return k;
+  }
+  return kernels.back();
+}
+
+const ScanKernels &scanKernels() {
+  static const ScanKernels kernels = selectScanKernels();
+  return kernels;
+}
+
+/*
+    Calls f(i) with i the offset of every bit of mask_of over p[0, n), in
+    increasing order. The last partial block is scanned from a zeroed copy,
+    so nothing past p + n is read.
+*/
+template <class F>
+void forEachMaskBit(uint64_t (*mask_of)(const char *), const char *p,
+                    size_t n, F f) {
+  size_t i = 0;
+  for (; i + kScanBlock <= n; i += kScanBlock) {
+    for (uint64_t mask = mask_of(p + i); mask != 0; mask &= mask - 1)
+      f(i + __builtin_ctzll(mask));
+  }
+  if (i < n) {
+    char tail[kScanBlock] = {0};
+    memcpy(tail, p + i, n - i);
+    uint64_t mask = mask_of(tail) & (UINT64_MAX >> (kScanBlock - (n - i)));
+    for (; mask != 0; mask &= mask - 1)
+      f(i + __builtin_ctzll(mask));
+  }
+}
+
+// calls f(i) for the offset of every ' ' and '\n' of p[0, n)
+template <class F> void forEachSeparator(const char *p, size_t n, F f) {
+  forEachMaskBit(scanKernels().separators, p, n, f);
+}
+
+// calls f(i) for the offset of the first byte of every char of p[0, n)
+template <class F> void forEachCharStart(const char *p, size_t n, F f) {
+  forEachMaskBit(scanKernels().charStarts, p, n, f);
+}
+
+// first ' ' or '\n' of [p, end), or end
+const char *findSeparator(const char *p, const char *end) {
+  auto mask_of = scanKernels().separators;
+  for (; p + kScanBlock <= end; p += kScanBlock) {
+    uint64_t mask = mask_of(p);
+    if (mask != 0)
+      return p + __builtin_ctzll(mask);
+  }
+  for (; p != end; p++) {
+    if (*p == ' ' || *p == '\n')
+      return p;
+  }
+  return end;
+}
+
+// ============================================================================
+// ============================== String arena ================================
+// ============================================================================
+
+/*
+    Strings stored back to back in one buffer, each one given a dense id:
+    string `id` is bytes[offsets[id], offsets[id + 1]). Interned strings are
+    indexed in a single open-addressing table of ids, so a string is stored
+    once, with no allocation of its own, and other structures refer to it by
+    its 32 bits id.
+*/
+class StringArena {
+public:
+  static const uint32_t kNone = UINT32_MAX;
+
+  size_t size() const { return offsets.size() - 1; }
+  const char *data(uint32_t id) const { return bytes.data() + offsets[id]; }
+  size_t length(uint32_t id) const { return offsets[id + 1] - offsets[id]; }
+  string str(uint32_t id) const { return string(data(id), length(id)); }
+
+  // id of the interned string [p, p + n), kNone if there is none
+  uint32_t find(const char *p, size_t n) const {
+    if (slots.empty())
+      return kNone;
+    uint32_t mask = slots.size() - 1;
+    for (uint32_t i = indexHash(p, n) & mask;; i = (i + 1) & mask) {
+      uint32_t id = slots[i];
+      if (id == kNone)
+        return kNone;
+      if (length(id) == n && memcmp(data(id), p, n) == 0)
+        return id;
+    }
+  }
+
+  // id of [p, p + n), added if it is not interned yet
+  uint32_t intern(const char *p, size_t n) {
+    if (2 * (indexed + 1) > slots.size())
+      rehash(max<size_t>(16, 2 * slots.size()));
+    uint32_t mask = slots.size() - 1;
+    uint32_t h = indexHash(p, n);
+    uint32_t i = h & mask;
+    for (; slots[i] != kNone; i = (i + 1) & mask) {
+      uint32_t id = slots[i];
+      if (length(id) == n && memcmp(data(id), p, n) == 0)
+        return id;
+    }
+    uint32_t id = append(p, n);
+    hashes[id] = h;
+    slots[i] = id;
+    indexed++;
+    return id;
+  }
+  uint32_t intern(const string &s) { return intern(s.data(), s.size()); }
+
+  /*
+      Adds [p, p + n) under a new id without indexing it: find() will not
+      see it, and interning the same string gives another id.
+  */
+  uint32_t append(const char *p, size_t n) {
+    uint32_t id = size();
+    bytes.insert(bytes.end(), p, p + n);
+    offsets.push_back(bytes.size());
+    hashes.push_back(kNone);
+    return id;
+  }
+
+  // appends the concatenation of strings `a` and `b`, not indexed
+  uint32_t appendConcat(uint32_t a, uint32_t b) {
+    uint32_t id = size();
+    size_t la = length(a), lb = length(b);
+    size_t at = bytes.size();
+    bytes.resize(at + la + lb);
+    memcpy(&bytes[at], data(a), la);
+    memcpy(&bytes[at + la], data(b), lb);
+    offsets.push_back(bytes.size());
+    hashes.push_back(kNone);
+    return id;
+  }
+
+  void reserve(size_t n, size_t total_bytes) {
+    bytes.reserve(total_bytes);
+    offsets.reserve(n + 1);
+    hashes.reserve(n);
+  }
+
+private:
+  // low bits of the hash of [p, p + n), never kNone which marks the
+  // strings that are not indexed
+  static uint32_t indexHash(const char *p, size_t n) {
+    uint32_t h = hashBytes(p, n);
+    return h != kNone ? h : kNone - 1;
+  }
+
+  void rehash(size_t n) {
+    slots.assign(n, kNone);
+    uint32_t mask = n - 1;
+    for (uint32_t id = 0; id < size(); id++) {
+      if (hashes[id] == kNone)
+        continue;
+      uint32_t i = hashes[id] & mask;
+      while (slots[i] != kNone)
+        i = (i + 1) & mask;
+      slots[i] = id;
+    }
+  }
+
+  vector<char> bytes;
+  vector<uint64_t> offsets{0};
+  // low bits of the hash of each interned string, kNone if not indexed
+  vector<uint32_t> hashes;
+  vector<uint32_t> slots;
+  size_t indexed = 0;
+};
+const uint32_t StringArena::kNone;
+
+/*
+    BPE of every word of an arena, back to back: the BPE of word `id` is
+    bpe[offsets[id], offsets[id + 1]).
+*/
+struct BpeTable {
+  StringArena words;
+  vector<char> bpe;
+  vector<uint64_t> offsets;
+};
+
+void printUsage() {
+  cerr
+      << "usage: fastbpe <command> <args>\n\n"
+      << "The commands supported by fastBPE are:\n\n"
+      << "getvocab input... [--shard output]   extract the vocabulary from text "
+         "files,\n"
+      << "                                     to a vocabulary shard with "
+         "--shard\n"
+      << "mergevocab output shard...           merge vocabulary shards into "
+         "one\n"
+      << "learnbpe nCodes input...             learn BPE codes from text files "
+         "or shards\n"
+      << "  [--checkpoint file]                save the learner state to file "
+         "every\n"
+      << "  [--checkpoint-every n]             n codes (1000) and at the end\n"
+      << "  [--init-codes codes]               start from the given codes\n"
+      << "learnbpe nCodes --resume file        go on learning from a "
+         "checkpoint\n"
+      << "applybpe output input codes [vocab]  apply BPE codes to a text file\n"
+      << "                                     (streamed when input or output "
+         "is -)\n"
+      << "unbpe output input                   join BPE subwords back into "
+         "words (- for\n"
+      << "                                     stdin or stdout)\n"
+      << "compile output codes [vocab]         compile codes and vocabulary "
+         "into a model\n"
+      << "                                     file to use in place of codes\n"
+      << "bench maps [nWords | input]          benchmark the hash tables\n"
+      << "bench scan [nWords | input]          benchmark the text scanning "
+         "kernels\n"
+      << "bench suite [--json output]          benchmark counting, learning "
+         "and applying\n"
+      << "  [--quick]                          on synthetic corpora\n"
+      << "--stats[=file]                       with any command, dump counters "
+         "and timers\n"
+      << "                                     as JSON to stderr or file\n"
+      << endl;
+}
+
+void print_word_count(const wCounts &wc) {
+  fprintf(stderr, "\nWord Counts\n");
+  fprintf(stderr, "--------------\n");
+  for (wCounts::const_iterator i = wc.begin(); i != wc.end(); ++i) {
+        cout << get<0>(*i) << " " << get<1>(*i) << endl;
+  }
+  fprintf(stderr, "\n--------------\n");
+}
+
+void print_word_map_count(const wMapCounts &wmc) {
+  fprintf(stderr, "\nWord Counts\n");
+  fprintf(stderr, "--------------\n");
+  for (auto x: wmc) {
+    cout << x.first << " " << x.second << endl;
+  }
+  fprintf(stderr, "--------------\n");
+}
+
+void padText(string &text) {
+  int l = text.length();
+  if (text[l] != ' ' or text[l] != '\n') text.push_back('\n');
+}
+
+int safeOpen(const char *file_path, int flags, mode_t mode = 0) {
+  int fd = open(file_path, flags, mode);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open text file %s\n", file_path);
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+/*
+    Counts the words of f[begin, end) into `counts`, keyed by views of `f`,
+    and lists them in `order` as they first appear. Returns the number of
+    words. As in a serial pass over the whole text, a last word not followed
+    by a separator is not counted, unless `ends_word` (f[end] is one).
+*/
+uint64_t countViews(const char *f, size_t begin, size_t end,
+                    FlatMap<StrView, uint32_t> &counts,
+                    vector<StrView> &order, bool ends_word) {
+  uint64_t total = 0;
+  size_t start = begin;
+  auto add_word = [&](size_t i) {
+    if (i > start) {
+      StrView word = {f + start, i - start};
+      auto it = counts.insert(word, 0);
+      if (it.second)
+        order.push_back(word);
+      (*it.first)++;
+      total++;
+    }
+    start = i + 1;
+  };
+  forEachSeparator(f + begin, end - begin,
+                   [&](size_t i) { add_word(begin + i); });
+  if (ends_word)
+    add_word(end);
+  return total;
+}
+
+// counts the words of f[begin, end) as countViews, returns their number
+uint64_t countWords(const char *f, size_t begin, size_t end,
+                    wMapCounts &word_count, bool ends_word) {
+  uint64_t total = 0;
+  size_t start = begin;
+  forEachSeparator(f + begin, end - begin, [&](size_t i) {
+    i += begin;
+    if (i > start) {
+      word_count[string(f + start, i - start)]++;
+      total++;
+    }
+    start = i + 1;
+  });
+  if (ends_word && end > start) {
+    word_count[string(f + start, end - start)]++;
+    total++;
+  }
+  return total;
+}
+
+// bounds of n chunks of f[0, size), moved forward to the next whitespace
+vector<size_t> chunkBounds(const char *f, size_t size, size_t n) {
+  vector<size_t> bounds(n + 1, size);
+  bounds[0] = 0;
+  for (size_t k = 1; k < n; k++) {
+    size_t pos = max(bounds[k - 1], k * (size / n));
+    bounds[k] = findSeparator(f + pos, f + size) - f;
+  }
+  return bounds;
+}
+
+/*
+    Counts the words of f[0, size) on the thread pool. The buffer is split at
+    whitespace into one chunk per thread and each chunk is counted into its
+    own table. The tables are reduced in parallel, each thread owning a shard
+    of the word hashes. New words are finally inserted in `word_count` in
+    the order they first appear in the text, as a serial count would do:
+    learnbpe numbers tokens in word_count order, which decides ties.
+*/
+uint64_t countWordsParallel(const char *f, size_t size,
+                            wMapCounts &word_count) {
+  auto &pool = ThreadPool::instance();
+  size_t n = pool.size();
+  if (n <= 1 || size < (1 << 20)) {
+    return countWords(f, 0, size, word_count, false);
+  }
+
+  vector<size_t> bounds = chunkBounds(f, size, n);
+
+  struct LocalWord {
+    StrView word;
+    uint32_t count;
+    uint32_t index; // rank of first occurrence in the chunk
+  };
+  // words of every chunk, as views of `f` by first occurrence, split by shard
+  vector<vector<StrView>> order(n);
+  vector<vector<vector<LocalWord>>> by_shard(n, vector<vector<LocalWord>>(n));
+  vector<uint64_t> totals(n, 0);
+  pool.runTasks(n, [&](size_t c) {
+    FlatMap<StrView, uint32_t> counts;
+    // chunks but the last one end at a separator
+    totals[c] = countViews(f, bounds[c], bounds[c + 1], counts, order[c],
+                           bounds[c + 1] < size);
+    for (uint32_t i = 0; i < order[c].size(); i++) {
+      auto &word = order[c][i];
+      by_shard[c][FlatKey<StrView>::hash(word) % n].push_back(
+          {word, *counts.find(word), i});
+    }
+  });
+
+  // first[c][i]: total count of the word first seen at order[c][i]
+  vector<vector<uint64_t>> first(n);
+  for (size_t c = 0; c < n; c++) {
+    first[c].assign(order[c].size(), 0);
+  }
+  pool.runTasks(n, [&](size_t shard) {
+    FlatMap<StrView, pair<size_t, uint32_t>> merged;
+    for (size_t c = 0; c < n; c++) {
+      for (auto &x : by_shard[c][shard]) {
+        auto it = merged.insert(x.word, make_pair(c, x.index));
+        first[it.first->first][it.first->second] += x.count;
+      }
+      vector<LocalWord>().swap(by_shard[c][shard]);
+    }
+  });
+
+  uint64_t total = 0;
+  for (size_t c = 0; c < n; c++) {
+    total += totals[c];
+    for (size_t i = 0; i < order[c].size(); i++) {
+      if (first[c][i] > 0)
+        word_count[string(order[c][i].p, order[c][i].n)] += first[c][i];
+    }
+  }
+  return total;
+}
+
+void readText(const char *fp, wMapCounts &word_count) {
+  uint64_t total = 0;
+
+  if (string(fp).compare("-") == 0) {
+    for (std::string line; std::getline(std::cin, line);) {
+      // the new line ends the last word of the line
+      total += countWords(line.data(), 0, line.size(), word_count, true);
+    }
+  }
+  else {
+    int fd = safeOpen(fp, O_RDONLY);
+
+    struct stat s;
+    fstat(fd, &s);
+    fprintf(stderr, "Loading vocabulary from %s ...\n", fp);
+
+    auto size = s.st_size;
+    if (size > 0) {
+      char *f = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      total = countWordsParallel(f, size, word_count);
+      munmap(f, size);
+    }
+    close(fd);
+  }
+  if (statsOn())
+    Stats::instance().add(Stats::kCountedWords, total);
+  fprintf(stderr, "Read %lu words (%lu unique) from text file.\n", total,
+          word_count.size());
+}
+
+// interns the distinct words of `text` into `words`
+void readString(const string &text, StringArena &words, bool verbose = true) {
+  uint64_t total = 0;
+  size_t start = 0;
+  forEachSeparator(text.data(), text.size(), [&](size_t i) {
+    if (i > start) {
+      words.intern(text.data() + start, i - start);
+      total++;
+    }
+    start = i + 1;
+  });
+  if (verbose)
+    fprintf(stderr, "Read %lu words (%lu unique) from string.\n", total,
+            words.size());
+}
+
+/*
+    Interns the distinct words of the text file `fp`, for applybpe which
+    needs no counts. Chunks of the mapped file are deduplicated in parallel,
+    keyed by views of the file, so only distinct words are ever copied.
+*/
+void readWords(const char *fp, StringArena &words) {
+  int fd = safeOpen(fp, O_RDONLY);
+  struct stat s;
+  fstat(fd, &s);
+  fprintf(stderr, "Loading vocabulary from %s ...\n", fp);
+
+  uint64_t total = 0;
+  size_t size = s.st_size;
+  if (size > 0) {
+    char *f = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    auto &pool = ThreadPool::instance();
+    size_t n = pool.size() > 1 && size >= (1 << 20) ? pool.size() : 1;
+    vector<size_t> bounds = chunkBounds(f, size, n);
+    vector<vector<StrView>> order(n);
+    vector<uint64_t> totals(n, 0);
+    pool.runTasks(n, [&](size_t c) {
+      FlatMap<StrView, uint32_t> counts;
+      totals[c] = countViews(f, bounds[c], bounds[c + 1], counts, order[c],
+                             bounds[c + 1] < size);
+    });
+    for (size_t c = 0; c < n; c++) {
+      total += totals[c];
+      for (auto &word : order[c]) {
+        words.intern(word.p, word.n);
+      }
+    }
+    munmap(f, size);
+  }
+  close(fd);
+  fprintf(stderr, "Read %lu words (%lu unique) from text file.\n", total,
+          words.size());
+}
+
+void readString(const string &text, wMapCounts &word_count,
+                bool verbose = true) {
+  uint64_t total = 0;
+  // a last word not followed by a separator is not counted
+  size_t start = 0;
+  forEachSeparator(text.data(), text.size(), [&](size_t i) {
+    if (i > start) {
+      word_count[text.substr(start, i - start)]++;
+      total++;
+    }
+    start = i + 1;
+  });
+
+  if (verbose)
+    fprintf(stderr, "Read %lu words (%lu unique) from string.\n", total,
+            word_count.size());
+}
+
+/*
+    Appends the BPE of f[begin, end) to `out`, separators being copied as
+    they are, and returns the number of words. Every word of the input must
+    be in `bpe`; as before, a last word not followed by a separator is not
+    written.
+*/
+uint64_t appendBpe(const BpeTable &bpe, const char *f, size_t begin,
+                   size_t end, string &out) {
+  uint64_t total = 0;
+  size_t out_size = out.size();
+  size_t start = begin;
+  forEachSeparator(f + begin, end - begin, [&](size_t i) {
+    i += begin;
+    // we reached a word boundary
+    if (i > start) {
+      // end of word : write bpe to output
+      uint32_t id = bpe.words.find(f + start, i - start);
+      assert(id != StringArena::kNone);
+      out.append(bpe.bpe.data() + bpe.offsets[id],
+                 bpe.offsets[id + 1] - bpe.offsets[id]);
+      total++;
+    }
+    out.push_back(f[i]);
+    start = i + 1;
+  });
+  if (statsOn()) {
+    auto &stats = Stats::instance();
+    stats.add(Stats::kWords, total);
+    stats.add(Stats::kBytesIn, end - begin);
+    stats.add(Stats::kBytesOut, out.size() - out_size);
+  }
+  return total;
+}
+
+string outputString(const string &text, const BpeTable &bpe) {
+  string outputStr;
+  outputStr.reserve(text.size() * 2);
+  appendBpe(bpe, text.data(), 0, text.size(), outputStr);
+  return outputStr;
+}
+
+// writes all of buf to fd
+void safeWrite(int fd, const char *buf, size_t size, const char *fpo) {
+  while (size > 0) {
+    ssize_t written = write(fd, buf, size);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Couldn't write to output file %s : %d.\n", fpo, errno);
+      exit(EXIT_FAILURE);
+    }
+    buf += written;
+    size -= written;
+  }
+}
+
+// writes all of buf at `offset` of fd
+void safePwrite(int fd, const char *buf, size_t size, off_t offset,
+                const char *fpo) {
+  while (size > 0) {
+    ssize_t written = pwrite(fd, buf, size, offset);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Couldn't write to output file %s : %d.\n", fpo, errno);
+      exit(EXIT_FAILURE);
+    }
+    buf += written;
+    size -= written;
+    offset += written;
+  }
+}
+
+/*
+    Writes the BPE of the input file to the output file in a single pass.
+    The mapped input is cut after word separators into chunks that are
+    encoded in parallel into local buffers, which are then written at their
+    final offset. Chunks are processed in rounds of one chunk per thread, so
+    the memory used stays bounded whatever the size of the input (or of its
+    lines).
+*/
+void outputText(const char *fpo, const char *fp, const BpeTable &bpe) {
+
+  int fd = safeOpen(fp, O_RDONLY);
+  auto fdOut = safeOpen(fpo, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+  struct stat s;
+  fstat(fd, &s);
+
+  fprintf(stderr, "Applying BPE to %s ...\n", fp);
+  size_t size = s.st_size;
+  char *f = nullptr;
+  if (size > 0) {
+    f = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (f == MAP_FAILED) {
+      fprintf(stderr, "Input memory map failed : %d.\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  auto &pool = ThreadPool::instance();
+  const size_t kChunkSize = 8 << 20;
+  size_t n = pool.size();
+  vector<string> buffers(n);
+  vector<size_t> bounds(n + 1);
+  vector<uint64_t> words(n);
+  uint64_t total = 0;
+  off_t out_size = 0;
+  for (size_t pos = 0; pos < size;) {
+    // next round of chunks, each one ending after a ' ' or a new line
+    size_t chunks = 0;
+    bounds[0] = pos;
+    while (chunks < n && bounds[chunks] < size) {
+      size_t end = min(size, bounds[chunks] + kChunkSize);
+      if (end < size)
+        end = min(size, size_t(findSeparator(f + end - 1, f + size) - f) + 1);
+      bounds[++chunks] = end;
+    }
+    pool.runTasks(chunks, [&](size_t c) {
+      buffers[c].clear();
+      words[c] = appendBpe(bpe, f, bounds[c], bounds[c + 1], buffers[c]);
+    });
+    // offsets of the chunks in the output file
+    vector<off_t> offsets(chunks);
+    for (size_t c = 0; c < chunks; c++) {
+      offsets[c] = out_size;
+      out_size += buffers[c].size();
+      total += words[c];
+    }
+    pool.runTasks(chunks, [&](size_t c) {
+      safePwrite(fdOut, buffers[c].data(), buffers[c].size(), offsets[c], fpo);
+    });
+    pos = bounds[chunks];
+  }
+
+  fprintf(stderr, "Modified %lu words from text file.\n", total);
+  if (f != nullptr)
+    munmap(f, size);
+  close(fdOut);
+  close(fd);
+}
+
+/*
+    All tokenized words stored back to back in a single array: word `wi` is
+    symbols[begin[wi], begin[wi] + length[wi]). Merges shrink a word in
+    place, so no per-symbol allocation is ever needed.
+*/
+struct FlatWords {
+  vector<uint32_t> symbols;
+  vector<size_t> begin;
+  vector<uint32_t> length;
+
+  size_t size() const { return begin.size(); }
+  uint32_t *word(size_t wi) { return symbols.data() + begin[wi]; }
+  const uint32_t *word(size_t wi) const { return symbols.data() + begin[wi]; }
+};
+
+void tokenize(const wMapCounts &word_count, StringArena &tokens,
+              FlatWords &words, vector<int32_t> &counts) {
+
+  size_t total_bytes = 0;
+  for (auto &x : word_count) {
+    total_bytes += x.first.size();
+  }
+  words.symbols.reserve(total_bytes);
+  words.begin.reserve(word_count.size());
+  words.length.reserve(word_count.size());
+
+  string last;
+  for (auto &x : word_count) {
+    auto &word = x.first;
+
+    words.begin.push_back(words.symbols.size());
+    counts.push_back(x.second);
+
+    // a token per char, the last one followed by kEndWord
+    size_t lastStart = 0;
+    forEachCharStart(word.data(), word.size(), [&](size_t pos) {
+      if (pos > 0) {
+        words.symbols.push_back(
+            tokens.intern(word.data() + lastStart, pos - lastStart));
+        lastStart = pos;
+      }
+    });
+    last.assign(word, lastStart, string::npos);
+    last += kEndWord;
+    words.symbols.push_back(tokens.intern(last));
+    words.length.push_back(words.symbols.size() - words.begin.back());
+  }
+}
+
+/*
+    Statistics of every pair currently present in the tokenized words: its
+    count and the words it appears in. Pairs are addressed by a stable slot
+    index; the slot of a pair whose count drops to zero is released and
+    reused by the next new pair, so the store only grows with the number of
+    live pairs.
+*/
+struct PairStats {
+  static const uint32_t kNoSlot = UINT32_MAX;
+
+  struct Stat {
+    tp pair;
+    int32_t count;
+    // words the pair (may) appear in, can contain duplicates
+    vector<uint32_t> where;
+  };
+
+  vector<Stat> stats;
+  vector<uint32_t> free_slots;
+  // pairKey -> slot
+  FlatMap<uint64_t, uint32_t> index;
+  size_t peak_pairs = 0;
+
+  uint32_t find(const tp &pair) const {
+    auto slot = index.find(pairKey(pair));
+    return slot != nullptr ? *slot : kNoSlot;
+  }
+
+  // slot of `pair`, creating it with a zero count if it is not there yet
+  uint32_t get(const tp &pair) {
+    auto it = index.insert(pairKey(pair), kNoSlot);
+    if (!it.second)
+      return *it.first;
+    uint32_t slot;
+    if (free_slots.empty()) {
+      slot = stats.size();
+      stats.push_back(Stat());
+    } else {
+      slot = free_slots.back();
+      free_slots.pop_back();
+    }
+    stats[slot].pair = pair;
+    stats[slot].count = 0;
+    *it.first = slot;
+    peak_pairs = max(peak_pairs, index.size());
+    return slot;
+  }
+
+  int32_t count(const tp &pair) const {
+    uint32_t slot = find(pair);
+    return slot != kNoSlot ? stats[slot].count : 0;
+  }
+
+  void add(uint32_t slot, int32_t v, uint32_t wi) {
+    auto &stat = stats[slot];
+    stat.count += v;
+    if (v > 0 && (stat.where.empty() || stat.where.back() != wi))
+      stat.where.push_back(wi);
+  }
+
+  // adds `v` to the count and words `where` (in increasing order)
+  void addAll(uint32_t slot, int32_t v, const vector<uint32_t> &where) {
+    auto &stat = stats[slot];
+    stat.count += v;
+    for (auto wi : where) {
+      if (stat.where.empty() || stat.where.back() != wi)
+        stat.where.push_back(wi);
+    }
+  }
+
+  void release(const tp &pair) {
+    auto slot = index.find(pairKey(pair));
+    if (slot == nullptr)
+      return;
+    auto &stat = stats[*slot];
+    stat.count = 0;
+    vector<uint32_t>().swap(stat.where);
+    free_slots.push_back(*slot);
+    index.erase(pairKey(pair));
+  }
+
+  size_t size() const { return index.size(); }
+};
+const uint32_t PairStats::kNoSlot;
+
+void count_in_word(const uint32_t *word, uint32_t length, uint32_t wi,
+                   uint32_t count, PairStats &pair_stats) {
+  for (uint32_t i = 1; i < length; i++) {
+    pair_stats.add(pair_stats.get(make_pair(word[i - 1], word[i])), count, wi);
+  }
+}
+
+/*
+    Pops the best pair out of a lazy max-heap. Entries whose count no longer
+    matches the pair's current count are stale: they are dropped, or pushed
+    back with the up to date count, when they reach the top. Every pair with
+    a positive count always has an entry at least as large as its count.
+    Returns false once no pair has a positive count left.
+*/
+bool find_maxp(pairHeap &heap, const PairStats &pair_stats, tp &maxp,
+               uint32_t &max_c) {
+  while (!heap.empty()) {
+    auto top = heap.top();
+    heap.pop();
+    int32_t cur = pair_stats.count(top.second);
+    if (cur == top.first) {
+      maxp = top.second;
+      max_c = cur;
+      return true;
+    }
+    if (cur > 0) {
+      heap.emplace(cur, top.second);
+    }
+  }
+  max_c = 0;
+  return false;
+}
+
+// peak resident memory of the process, in KB
+uint64_t peakMemoryKB() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// ===== vocabulary shards =====
+
+/*
+    A vocabulary shard holds the counts of words of some part of a corpus,
+    sorted by word (bytewise), so that any number of shards can be merged
+    in a single streaming pass:
+
+      ShardHeader
+      num_words times: uint32_t length, the word bytes, uint64_t count
+*/
+const char kShardMagic[8] = {'f', 'a', 's', 't', 'B', 'P', 'E', 'v'};
+const uint32_t kShardVersion = 1;
+
+struct ShardHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t num_words;
+  // sum of the counts
+  uint64_t total;
+};
+
+class ShardWriter {
+public:
+  explicit ShardWriter(const char *fp) : path(fp) {
+    f = fopen(fp, "wb");
+    if (f == nullptr) {
+      fprintf(stderr, "Cannot open shard file %s\n", fp);
+      exit(EXIT_FAILURE);
+    }
+    memcpy(h.magic, kShardMagic, sizeof(h.magic));
+    h.version = kShardVersion;
+    h.byte_order = kByteOrderMark;
+    h.num_words = 0;
+    h.total = 0;
+    // written again with the final counts by close()
+    fwrite(&h, sizeof(h), 1, f);
+  }
+
+  // words must come in increasing order
+  void add(const char *p, uint32_t n, uint64_t count) {
+    fwrite(&n, sizeof(n), 1, f);
+    fwrite(p, 1, n, f);
+    fwrite(&count, sizeof(count), 1, f);
+    h.num_words++;
+    h.total += count;
+  }
+
+  const ShardHeader &close() {
+    fseek(f, 0, SEEK_SET);
+    fwrite(&h, sizeof(h), 1, f);
+    if (ferror(f) || fclose(f) != 0) {
+      fprintf(stderr, "Cannot write shard file %s : %d.\n", path, errno);
+      exit(EXIT_FAILURE);
+    }
+    return h;
+  }
+
+private:
+  const char *path;
+  FILE *f;
+  ShardHeader h;
+};
+
+// reads the entries of a shard one at a time, checking their order
+class ShardReader {
+public:
+  explicit ShardReader(const char *fp) : path(fp) {
+    f = fopen(fp, "rb");
+    if (f == nullptr) {
+      fprintf(stderr, "Cannot open shard file %s\n", fp);
+      exit(EXIT_FAILURE);
+    }
+    if (fread(&h, sizeof(h), 1, f) != 1 ||
+        memcmp(h.magic, kShardMagic, sizeof(h.magic)) != 0 ||
+        h.version != kShardVersion || h.byte_order != kByteOrderMark) {
+      fprintf(stderr, "%s is not a vocabulary shard of this version of fastBPE\n",
+              fp);
+      exit(EXIT_FAILURE);
+    }
+    setvbuf(f, nullptr, _IOFBF, 1 << 20);
+  }
+  ~ShardReader() { fclose(f); }
+
+  static bool isShard(const char *fp) {
+    char magic[sizeof(kShardMagic)];
+    int fd = open(fp, O_RDONLY);
+    if (fd < 0)
+      return false;
+    bool is_shard = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+                    memcmp(magic, kShardMagic, sizeof(magic)) == 0;
+    close(fd);
+    return is_shard;
+  }
+
+  const ShardHeader &header() const { return h; }
+
+  // moves to the next entry, false once all were read
+  bool next() {
+    if (read_words == h.num_words)
+      return false;
+    uint32_t n;
+    bool ok = fread(&n, sizeof(n), 1, f) == 1;
+    previous.swap(word);
+    word.resize(n);
+    ok = ok && fread(&word[0], 1, n, f) == n &&
+         fread(&count, sizeof(count), 1, f) == 1;
+    if (!ok || (read_words > 0 && !(previous < word))) {
+      fprintf(stderr, "Corrupted shard file %s\n", path);
+      exit(EXIT_FAILURE);
+    }
+    read_words++;
+    return true;
+  }
+
+  string word;
+  uint64_t count = 0;
+
+private:
+  const char *path;
+  FILE *f;
+  ShardHeader h;
+  uint64_t read_words = 0;
+  string previous;
+};
+
+void writeShard(const char *fp, const wMapCounts &word_count) {
+  vector<const wMapCounts::value_type *> sorted;
+  sorted.reserve(word_count.size());
+  for (auto &x : word_count) {
+    sorted.push_back(&x);
+  }
+  sort(sorted.begin(), sorted.end(),
+       [](const wMapCounts::value_type *a, const wMapCounts::value_type *b) {
+         return a->first < b->first;
+       });
+  ShardWriter shard(fp);
+  for (auto x : sorted) {
+    shard.add(x->first.data(), x->first.size(), x->second);
+  }
+  auto &h = shard.close();
+  fprintf(stderr, "Wrote %lu words (%lu unique) to %s\n", h.total,
+          h.num_words, fp);
+}
+
+void readShard(const char *fp, wMapCounts &word_count) {
+  ShardReader shard(fp);
+  fprintf(stderr, "Loading vocabulary from %s ...\n", fp);
+  word_count.reserve(word_count.size() + shard.header().num_words);
+  while (shard.next()) {
+    auto &c = word_count[shard.word];
+    if (c + shard.count > INT32_MAX) {
+      fprintf(stderr, "The count of a word of %s overflows\n", fp);
+      exit(EXIT_FAILURE);
+    }
+    c += shard.count;
+  }
+  fprintf(stderr, "Read %lu words (%lu unique) from vocabulary shard.\n",
+          shard.header().total, shard.header().num_words);
+}
+
+// words of a text file, or of a vocabulary shard
+void readCounts(const char *fp, wMapCounts &word_count) {
+  if (string(fp) != "-" && ShardReader::isShard(fp))
+    readShard(fp, word_count);
+  else
+    readText(fp, word_count);
+}
+
+/*
+    Merges vocabulary shards into one, summing the counts of equal words.
+    A k-way merge: only the current entry of each shard is in memory.
+*/
+void mergevocab(const char *output, const vector<const char *> &inputs) {
+  vector<unique_ptr<ShardReader>> shards;
+  // min-heap of the shards by current word
+  auto greater_word = [&](size_t a, size_t b) {
+    return shards[b]->word < shards[a]->word;
+  };
+  priority_queue<size_t, vector<size_t>, decltype(greater_word)> heap(
+      greater_word);
+  for (auto fp : inputs) {
+    shards.emplace_back(new ShardReader(fp));
+    if (shards.back()->next())
+      heap.push(shards.size() - 1);
+  }
+
+  ShardWriter out(output);
+  // word being summed and its count so far
+  string word;
+  uint64_t count = 0;
+  bool has_word = false;
+  while (!heap.empty()) {
+    size_t i = heap.top();
+    heap.pop();
+    auto &shard = *shards[i];
+    if (!has_word || shard.word != word) {
+      if (has_word)
+        out.add(word.data(), word.size(), count);
+      word = shard.word;
+      count = 0;
+      has_word = true;
+    }
+    count += shard.count;
+    if (shard.next())
+      heap.push(i);
+  }
+  if (has_word)
+    out.add(word.data(), word.size(), count);
+  auto &h = out.close();
+  fprintf(stderr, "Merged %lu shards into %lu words (%lu unique) in %s\n",
+          inputs.size(), h.total, h.num_words, output);
+}
+
+void getvocab(const vector<const char *> &inputs, const char *shard) {
+  // get vocab
+  wMapCounts word_count;
+  for (auto fp : inputs) {
+    readText(fp, word_count);
+  }
+  if (shard != nullptr) {
+    writeShard(shard, word_count);
+    return;
+  }
+
+  // sort vocab
+  auto compFunctor = [](pair<string, int> elem1, pair<string, int> elem2) {
+    return elem1.second > elem2.second ||
+           (elem1.second == elem2.second && elem1.first < elem2.first);
+  };
+  set<pair<string, int>, decltype(compFunctor)> sorted_vocab(
+      word_count.begin(), word_count.end(), compFunctor);
+  assert(word_count.size() == sorted_vocab.size());
+
+  // // print sorted vocab
+  // for (auto element : sorted_vocab)
+  //   cout << element.first << " " << element.second << endl;
+}
+
+
+wMapCounts getvocabs(string &text) {
+  // append space char at the end to
+  padText(text);
+  // get vocab
+  wMapCounts word_count;
+  readString(text, word_count);
+  return word_count;
+}
+
+/*
+    Merges `max_p` into `new_token` in word `wi`, in place, and calls
+    emit(pair, delta, wi) for every change of the pair counts.
+*/
+template <class F>
+void mergeInWord(FlatWords &words, uint32_t wi, const tp &max_p,
+                 uint32_t new_token, int32_t count, F &emit) {
+  // `out` is the merged prefix of the word and `w` its length, `r` walks
+  // the symbols not merged yet
+  uint32_t *out = words.word(wi);
+  const uint32_t length = words.length[wi];
+  uint32_t w = 0;
+  for (uint32_t r = 0; r < length; r++) {
+    uint32_t cur = out[r];
+    if (w > 0 && out[w - 1] == max_p.first && cur == max_p.second) {
+      // if there is a token before the pair
+      if (w > 1) {
+        emit(make_pair(out[w - 2], max_p.first), -count, wi);
+        emit(make_pair(out[w - 2], new_token), count, wi);
+      }
+      // if there is a token after the pair
+      if (r + 1 < length) {
+        emit(make_pair(max_p.second, out[r + 1]), -count, wi);
+        emit(make_pair(new_token, out[r + 1]), count, wi);
+      }
+      out[w - 1] = new_token;
+    } else {
+      out[w++] = cur;
+    }
+  }
+  words.length[wi] = w;
+}
+
+/*
+    Merges `max_p` in the words of `to_update` on the thread pool. Each
+    thread rewrites a contiguous range of the words and logs its pair count
+    changes, split by pair hash into one shard per thread. Shards are then
+    reduced in parallel, in word order, to one delta per pair with the words
+    it was added to, and applied to `pair_stats`. Sums do not depend on the
+    order, so counts, and the learned codes, are those of a serial merge.
+*/
+void mergeParallel(FlatWords &words, const vector<int32_t> &counts,
+                   const vector<uint32_t> &to_update, const tp &max_p,
+                   uint32_t new_token, PairStats &pair_stats,
+                   vector<tp> &touched) {
+  auto &pool = ThreadPool::instance();
+  size_t n = pool.size();
+  struct Change {
+    uint64_t key;
+    int32_t v;
+    uint32_t wi;
+  };
+  vector<vector<vector<Change>>> logs(n, vector<vector<Change>>(n));
+  size_t per = (to_update.size() + n - 1) / n;
+  pool.runTasks(n, [&](size_t c) {
+    auto log = [&](const tp &pair, int32_t v, uint32_t wi) {
+      uint64_t key = pairKey(pair);
+      logs[c][hashKey(key) % n].push_back({key, v, wi});
+    };
+    size_t end = min(to_update.size(), (c + 1) * per);
+    for (size_t k = c * per; k < end; k++) {
+      uint32_t wi = to_update[k];
+      mergeInWord(words, wi, max_p, new_token, counts[wi], log);
+    }
+  });
+
+  struct Reduced {
+    uint64_t key;
+    int32_t v;
+    bool added;
+    vector<uint32_t> where;
+  };
+  vector<vector<Reduced>> reduced(n);
+  pool.runTasks(n, [&](size_t shard) {
+    FlatMap<uint64_t, uint32_t> index;
+    auto &out = reduced[shard];
+    for (size_t c = 0; c < n; c++) {
+      for (auto &x : logs[c][shard]) {
+        auto it = index.insert(x.key, out.size());
+        if (it.second)
+          out.push_back({x.key, 0, false, vector<uint32_t>()});
+        auto &r = out[*it.first];
+        r.v += x.v;
+        if (x.v > 0) {
+          r.added = true;
+          if (r.where.empty() || r.where.back() != x.wi)
+            r.where.push_back(x.wi);
+        }
+      }
+      vector<Change>().swap(logs[c][shard]);
+    }
+  });
+
+  for (auto &shard : reduced) {
+    for (auto &r : shard) {
+      tp pair(r.key >> 32, uint32_t(r.key));
+      touched.push_back(pair);
+      // as in a serial merge, only an added pair gets a slot
+      uint32_t slot = r.added ? pair_stats.get(pair) : pair_stats.find(pair);
+      if (slot != PairStats::kNoSlot)
+        pair_stats.addAll(slot, r.v, r.where);
+    }
+  }
+}
+
+/*
+    Everything the learner needs to go on merging: the tokens, the words
+    as merged so far, the pair statistics and the codes learned. Tokens
+    [0, num_base) are the characters of the words, the following ones are
+    the results of the merges, in order.
+*/
+struct LearnState {
+  StringArena tokens;
+  uint32_t num_base = 0;
+  FlatWords words;
+  vector<int32_t> counts;
+  PairStats pair_stats;
+  tripletVec codes;
+};
+
+// pair statistics of the words as they are
+void countPairs(LearnState &state) {
+  for (uint32_t wi = 0; wi < state.words.size(); wi++) {
+    count_in_word(state.words.word(wi), state.words.length[wi], wi,
+                  state.counts[wi], state.pair_stats);
+  }
+}
+
+void initLearnState(const wMapCounts &word_count, LearnState &state) {
+  tokenize(word_count, state.tokens, state.words, state.counts);
+  state.num_base = state.tokens.size();
+}
+
+/*
+    Brings a freshly tokenized state to where learning `codes` would have
+    left it, without searching for the best pair at each step. Merge ranks
+    are resolved to token ids first, then every word is merged on its own,
+    lowest rank first, on the thread pool. A merge only creates pairs with
+    its new token, which ranks after it, so this gives the words of a
+    sequential replay. Codes whose tokens never appear are kept, but merge
+    nothing. Pairs are not counted: countPairs does it once afterwards.
+*/
+void replayCodes(const tripletVec &codes, LearnState &state) {
+  assert(state.codes.empty() && state.tokens.size() == state.num_base);
+  auto &tokens = state.tokens;
+  // latest token of each string, and pairKey -> rank
+  unordered_map<string, uint32_t> by_string;
+  for (uint32_t id = 0; id < tokens.size(); id++) {
+    by_string[tokens.str(id)] = id;
+  }
+  FlatMap<uint64_t, uint32_t> ranks;
+  size_t unknown = 0;
+  for (auto &code : codes) {
+    auto left = by_string.find(get<0>(code));
+    auto right = by_string.find(get<1>(code));
+    uint32_t id;
+    if (left != by_string.end() && right != by_string.end()) {
+      ranks.insert(pairKey(make_pair(left->second, right->second)),
+                   state.codes.size());
+      id = tokens.appendConcat(left->second, right->second);
+    } else {
+      string merged = get<0>(code) + get<1>(code);
+      id = tokens.append(merged.data(), merged.size());
+      unknown++;
+    }
+    by_string[tokens.str(id)] = id;
+    state.codes.push_back(code);
+  }
+
+  // as Encoder::mergeWord: the symbols of a word are a linked list, its
+  // pairs are queued by rank then position, so equal pairs merge left to
+  // right as in mergeInWord
+  auto &words = state.words;
+  ThreadPool::instance().parallelFor(
+      words.size(), 1024, [&](size_t begin, size_t end) {
+        struct Symbol {
+          uint32_t id;
+          int32_t prev, next;
+        };
+        vector<Symbol> symbols;
+        // (rank, position of the left symbol, left id, right id)
+        using candidate = tuple<uint32_t, int32_t, uint32_t, uint32_t>;
+        priority_queue<candidate, vector<candidate>, greater<candidate>> queue;
+        auto push_pair = [&](int32_t i) {
+          if (i < 0 || symbols[i].next < 0)
+            return;
+          uint32_t left = symbols[i].id, right = symbols[symbols[i].next].id;
+          auto rank = ranks.find(pairKey(make_pair(left, right)));
+          if (rank != nullptr)
+            queue.emplace(*rank, i, left, right);
+        };
+
+        for (size_t wi = begin; wi < end; wi++) {
+          uint32_t *w = words.word(wi);
+          int32_t length = words.length[wi];
+          symbols.clear();
+          for (int32_t i = 0; i < length; i++) {
+            symbols.push_back({w[i], i - 1, i + 1});
+          }
+          symbols.back().next = -1;
+          for (int32_t i = 0; i + 1 < length; i++) {
+            push_pair(i);
+          }
+
+          while (!queue.empty()) {
+            uint32_t rank, left, right;
+            int32_t i;
+            tie(rank, i, left, right) = queue.top();
+            queue.pop();
+            auto &sym = symbols[i];
+            // skip pairs that changed since they were queued
+            if (sym.id != left || sym.next < 0 || symbols[sym.next].id != right)
+              continue;
+            auto &next = symbols[sym.next];
+            sym.id = state.num_base + rank;
+            next.id = UINT32_MAX;
+            sym.next = next.next;
+            if (sym.next >= 0)
+              symbols[sym.next].prev = i;
+            push_pair(sym.prev);
+            push_pair(i);
+          }
+
+          uint32_t out = 0;
+          for (int32_t i = 0; i >= 0; i = symbols[i].next) {
+            w[out++] = symbols[i].id;
+          }
+          words.length[wi] = out;
+        }
+      });
+  if (unknown > 0)
+    fprintf(stderr, "%lu codes have tokens missing from the vocabulary.\n",
+            unknown);
+}
+
+// ===== checkpoints =====
+
+const char kCheckpointMagic[8] = {'f', 'a', 's', 't', 'B', 'P', 'E', 'c'};
+const uint32_t kCheckpointVersion = 1;
+
+// appends the raw bytes of n values to a checkpoint buffer
+template <class T> void putValues(vector<char> &out, const T *p, size_t n) {
+  out.insert(out.end(), (const char *)p, (const char *)(p + n));
+}
+template <class T> void putValue(vector<char> &out, const T &v) {
+  putValues(out, &v, 1);
+}
+template <class T> void putVector(vector<char> &out, const vector<T> &v) {
+  putValue<uint64_t>(out, v.size());
+  putValues(out, v.data(), v.size());
+}
+void putString(vector<char> &out, const string &s) {
+  putValue<uint64_t>(out, s.size());
+  putValues(out, s.data(), s.size());
+}
+
+// reads back what the put* functions wrote, exits on a truncated file
+struct CheckpointReader {
+  const char *p, *end;
+  const char *path;
+
+  void get(void *dst, size_t n) {
+    if (size_t(end - p) < n) {
+      fprintf(stderr, "Truncated checkpoint file %s\n", path);
+      exit(EXIT_FAILURE);
+    }
+    memcpy(dst, p, n);
+    p += n;
+  }
+  template <class T> T value() {
+    T v;
+    get(&v, sizeof(T));
+    return v;
+  }
+  template <class T> void vec(vector<T> &v) {
+    v.resize(value<uint64_t>());
+    get(v.data(), v.size() * sizeof(T));
+  }
+  string str() {
+    string s(value<uint64_t>(), '\0');
+    get(&s[0], s.size());
+    return s;
+  }
+};
+
+/*
+    Writes the learner state to `path`: tokens, merged words, live pair
+    statistics and codes. The file is written aside and renamed over
+    `path`, so an interrupted write leaves the previous checkpoint intact.
+*/
+void saveCheckpoint(const char *path, const LearnState &state) {
+  vector<char> out;
+  putValues(out, kCheckpointMagic, 8);
+  putValue(out, kCheckpointVersion);
+  putValue(out, kByteOrderMark);
+
+  putValue(out, state.num_base);
+  putValue<uint64_t>(out, state.tokens.size());
+  for (uint32_t id = 0; id < state.tokens.size(); id++) {
+    putValue<uint64_t>(out, state.tokens.length(id));
+    putValues(out, state.tokens.data(id), state.tokens.length(id));
+  }
+  putVector(out, state.words.symbols);
+  putVector(out, state.words.begin);
+  putVector(out, state.words.length);
+  putVector(out, state.counts);
+
+  auto &pair_stats = state.pair_stats;
+  putValue<uint64_t>(out, pair_stats.size());
+  putValue<uint64_t>(out, pair_stats.peak_pairs);
+  pair_stats.index.forEach([&](uint64_t key, uint32_t slot) {
+    auto &stat = pair_stats.stats[slot];
+    putValue(out, key);
+    putValue(out, stat.count);
+    putVector(out, stat.where);
+  });
+
+  putValue<uint64_t>(out, state.codes.size());
+  for (auto &code : state.codes) {
+    putString(out, get<0>(code));
+    putString(out, get<1>(code));
+    putValue(out, get<2>(code));
+  }
+
+  string tmp = string(path) + ".tmp";
+  int fd = safeOpen(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  safePwrite(fd, out.data(), out.size(), 0, tmp.c_str());
+  if (fsync(fd) < 0 || close(fd) < 0 || rename(tmp.c_str(), path) < 0) {
+    fprintf(stderr, "Cannot write checkpoint file %s : %d.\n", path, errno);
+    exit(EXIT_FAILURE);
+  }
+}
+
+void loadCheckpoint(const char *path, LearnState &state) {
+  ifstream file(path, ios::binary);
+  if (!file) {
+    fprintf(stderr, "Cannot open checkpoint file %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  vector<char> in((istreambuf_iterator<char>(file)),
+                  istreambuf_iterator<char>());
+  CheckpointReader r{in.data(), in.data() + in.size(), path};
+  char magic[8];
+  r.get(magic, 8);
+  if (memcmp(magic, kCheckpointMagic, 8) != 0 ||
+      r.value<uint32_t>() != kCheckpointVersion ||
+      r.value<uint32_t>() != kByteOrderMark) {
+    fprintf(stderr, "%s is not a checkpoint of this version of fastBPE\n",
+            path);
+    exit(EXIT_FAILURE);
+  }
+
+  state.num_base = r.value<uint32_t>();
+  uint64_t num_tokens = r.value<uint64_t>();
+  for (uint64_t id = 0; id < num_tokens; id++) {
+    string token = r.str();
+    // as after learning, only the characters are interned
+    if (id < state.num_base)
+      state.tokens.intern(token);
+    else
+      state.tokens.append(token.data(), token.size());
+  }
+  r.vec(state.words.symbols);
+  r.vec(state.words.begin);
+  r.vec(state.words.length);
+  r.vec(state.counts);
+
+  auto &pair_stats = state.pair_stats;
+  uint64_t num_pairs = r.value<uint64_t>();
+  uint64_t peak_pairs = r.value<uint64_t>();
+  for (uint64_t i = 0; i < num_pairs; i++) {
+    uint64_t key = r.value<uint64_t>();
+    uint32_t slot = pair_stats.get(tp(key >> 32, uint32_t(key)));
+    pair_stats.stats[slot].count = r.value<int32_t>();
+    r.vec(pair_stats.stats[slot].where);
+  }
+  pair_stats.peak_pairs = max<size_t>(peak_pairs, pair_stats.size());
+
+  uint64_t num_codes = r.value<uint64_t>();
+  for (uint64_t i = 0; i < num_codes; i++) {
+    string left = r.str();
+    string right = r.str();
+    state.codes.emplace_back(left, right, r.value<uint32_t>());
+  }
+  if (state.tokens.size() != state.num_base + state.codes.size()) {
+    fprintf(stderr, "Corrupted checkpoint file %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// ===== learning =====
+
+struct LearnOptions {
+  // checkpoint written every `checkpoint_every` merges and at the end
+  const char *checkpoint = nullptr;
+  uint32_t checkpoint_every = 1000;
+  // state to start from: a checkpoint, or codes replayed on the input
+  const char *resume = nullptr;
+  const char *init_codes = nullptr;
+  bool print = false;
+  // time of each merge in ns, appended when given (whatever the stats)
+  vector<uint64_t> *merge_ns = nullptr;
+};
+
+/*
+    Learns codes until `state` has `kNPairs` of them, or nothing is left
+    to merge, and returns all its codes.
+*/
+tripletVec learnCodes(const uint32_t kNPairs, LearnState &state,
+                      const LearnOptions &options) {
+  auto &tokens = state.tokens;
+  auto &words = state.words;
+  auto &counts = state.counts;
+  auto &pair_stats = state.pair_stats;
+  auto &codes = state.codes;
+
+  if (options.print) {
+    for (auto &code : codes)
+      cout << get<0>(code) << " " << get<1>(code) << " " << get<2>(code)
+           << endl;
+  }
+
+  uint32_t max_c = 0;
+  tp max_p;
+  vector<pair<int32_t, tp>> initial_counts;
+  for (auto &x : pair_stats.stats) {
+    if (x.count > 0)
+      initial_counts.emplace_back(x.count, x.pair);
+  }
+  pairHeap heap(pair_count_less(), move(initial_counts));
+  // pairs whose count changed during the current merge
+  vector<tp> touched;
+  vector<uint32_t> to_update;
+
+  while (codes.size() < kNPairs) {
+    StatTimer merge_timer(Stats::kLearnNs);
+    auto merge_start = chrono::steady_clock::now();
+    // stop once there is nothing left to merge
+    if (!find_maxp(heap, pair_stats, max_p, max_c))
+      break;
+
+    // create new token for pair. replace
+    codes.push_back(triplet(tokens.str(max_p.first), tokens.str(max_p.second),
+                            max_c));
+
+    if (options.print)
+      cout << get<0>(codes.back()) << " " << get<1>(codes.back()) << " "
+           << max_c << endl;
+
+    // a merge always gives a new token, even if its string already exists
+    uint32_t new_token_id = tokens.appendConcat(max_p.first, max_p.second);
+    touched.clear();
+    auto change_count = [&](tp pair, int32_t v, uint32_t wi) {
+      touched.push_back(pair);
+      if (v > 0) {
+        pair_stats.add(pair_stats.get(pair), v, wi);
+      } else {
+        uint32_t slot = pair_stats.find(pair);
+        if (slot != PairStats::kNoSlot)
+          pair_stats.add(slot, v, wi);
+      }
+    };
+
+    // words to update, each one once (and in order)
+    to_update.swap(pair_stats.stats[pair_stats.find(max_p)].where);
+    sort(to_update.begin(), to_update.end());
+    to_update.erase(unique(to_update.begin(), to_update.end()),
+                    to_update.end());
+
+    auto &pool = ThreadPool::instance();
+    if (pool.size() > 1 && to_update.size() > pool.inlineThreshold()) {
+      mergeParallel(words, counts, to_update, max_p, new_token_id, pair_stats,
+                    touched);
+    } else {
+      for (auto wi : to_update) {
+        mergeInWord(words, wi, max_p, new_token_id, counts[wi], change_count);
+      }
+    }
+
+    // the merged pair is gone from every word
+    pair_stats.release(max_p);
+    // re-queue every pair whose count changed with its new count, and
+    // release the ones that disappeared
+    sort(touched.begin(), touched.end());
+    touched.erase(unique(touched.begin(), touched.end()), touched.end());
+    for (auto &pair : touched) {
+      int32_t count = pair_stats.count(pair);
+      if (count > 0)
+        heap.emplace(count, pair);
+      else
+        pair_stats.release(pair);
+    }
+    if (statsOn()) {
+      uint64_t ns = merge_timer.stop();
+      Stats::instance().addLearnIteration(ns, pair_stats.size());
+    }
+    if (options.merge_ns != nullptr)
+      options.merge_ns->push_back(
+          chrono::duration_cast<chrono::nanoseconds>(
+              chrono::steady_clock::now() - merge_start)
+              .count());
+
+    if (options.checkpoint != nullptr &&
+        codes.size() % options.checkpoint_every == 0)
+      saveCheckpoint(options.checkpoint, state);
+  }
+  if (options.checkpoint != nullptr &&
+      (codes.empty() || codes.size() % options.checkpoint_every != 0))
+    saveCheckpoint(options.checkpoint, state);
+  if (statsOn()) {
+    Stats::instance().setMax(Stats::kPeakPairs, pair_stats.peak_pairs);
+    Stats::instance().setMax(Stats::kPeakMemoryKB, peakMemoryKB());
+  }
+  return codes;
+}
+
+tripletVec _learnbpe(const uint32_t kNPairs, const wMapCounts &word_count, bool print = false){
+  LearnState state;
+  initLearnState(word_count, state);
+  countPairs(state);
+  LearnOptions options;
+  options.print = print;
+  return learnCodes(kNPairs, state, options);
+}
+
+tripletVec learnbpes(const uint32_t kNPairs, string &text) {
+  wMapCounts word_count = getvocabs(text);
+  tripletVec codes = _learnbpe(kNPairs, word_count);
+  return codes;
+}
+
+void split(vector<string> &splits, const string &text, char sep) {
+  size_t start = 0, end = 0;
+  while ((end = text.find(sep, start)) != string::npos) {
+    if (end != start)
+      splits.push_back(text.substr(start, end - start));
+    start = end + 1;
+  }
+  if (end != start && start < text.size())
+    splits.push_back(text.substr(start));
+}
+
+void readVocab(const char *fp, wMapCounts &vocab,
+               vector<string> *order = nullptr) {
+  ifstream file(fp);
+  if (!file) {
+    fprintf(stderr, "Cannot open vocabulary file %s\n", fp);
+    exit(EXIT_FAILURE);
   }
   fprintf(stderr, "Loading vocabulary from %s ...\n", fp);
   string line;
@@ -568,233 +2406,1820 @@ void readVocab(const char *fp, wMapCounts &vocab) {
     assert(vocab.find(splits[0]) == vocab.end());
     int count = stoi(splits[1]);
     vocab[splits[0]] = count;
+    if (order != nullptr)
+      order->push_back(splits[0]);
     total += count;
   }
-  fprintf(stderr, "Read %lu words (%lu unique) from vocabulary file.\n", total,
-          vocab.size());
+  fprintf(stderr, "Read %lu words (%lu unique) from vocabulary file.\n", total,
+          vocab.size());
+}
+
+void readCodes(const char *fp, codesMap &codes,
+               reverseCodesMap &reversed_codes) {
+  ifstream file(fp);
+  if (!file) {
+    fprintf(stderr, "Cannot open codes file %s\n", fp);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, "Loading codes from %s ...\n", fp);
+  string line;
+  while (getline(file, line)) {
+    vector<string> splits;
+    split(splits, line, ' ');
+    assert(splits.size() == 3);
+    auto pair = make_pair(splits[0], splits[1]);
+    string concat = splits[0] + splits[1];
+    assert(codes.find(pair) == codes.end());
+    assert(reversed_codes.find(concat) == reversed_codes.end());
+    codes[pair] = codes.size();
+    reversed_codes[concat] = pair;
+  }
+  fprintf(stderr, "Read %lu codes from the codes file.\n", codes.size());
+}
+
+// codes of a codes file, in order
+void readCodes(const char *fp, tripletVec &codes) {
+  ifstream file(fp);
+  if (!file) {
+    fprintf(stderr, "Cannot open codes file %s\n", fp);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, "Loading codes from %s ...\n", fp);
+  string line;
+  while (getline(file, line)) {
+    vector<string> splits;
+    split(splits, line, ' ');
+    assert(splits.size() == 3);
+    codes.emplace_back(splits[0], splits[1], stoi(splits[2]));
+  }
+  fprintf(stderr, "Read %lu codes from the codes file.\n", codes.size());
+}
+
+tripletVec learnbpe(const uint32_t kNPairs,
+                    const vector<const char *> &inputs,
+                    const LearnOptions &options) {
+  LearnState state;
+  if (options.resume != nullptr) {
+    loadCheckpoint(options.resume, state);
+    fprintf(stderr, "Resuming from %lu codes of %s\n", state.codes.size(),
+            options.resume);
+  } else {
+    // get vocab, from text files or shards
+    wMapCounts word_count;
+    for (auto fp : inputs) {
+      readCounts(fp, word_count);
+    }
+    initLearnState(word_count, state);
+    if (options.init_codes != nullptr) {
+      tripletVec codes;
+      readCodes(options.init_codes, codes);
+      if (codes.size() > kNPairs)
+        codes.resize(kNPairs);
+      replayCodes(codes, state);
+    }
+    countPairs(state);
+  }
+  return learnCodes(kNPairs, state, options);
+}
+
+
+// ============================================================================
+// =============================== BPE cache ==================================
+// ============================================================================
+
+// a word once encoded: its BPE string and the ids of its tokens
+struct EncodedWord {
+  string bpe;
+  vector<int32_t> ids;
+};
+
+/*
+    Bounded word -> encoded word cache, shared by every call and thread using
+    an encoder. Words are spread over shards by hash, each shard being an
+    LRU list guarded by its own mutex. A capacity of 0 disables the cache.
+*/
+class BpeCache {
+public:
+  explicit BpeCache(size_t capacity) : shards(kCacheShards) {
+    setCapacity(capacity);
+  }
+
+  /*
+      Resizes the cache while other threads may use it: every shard is
+      locked, so no lookup or insert runs against the old shard count, and
+      the shards left out get no capacity and no entries.
+  */
+  void setCapacity(size_t capacity) {
+    vector<unique_lock<mutex>> locks;
+    for (auto &shard : shards)
+      locks.emplace_back(shard.m);
+    // small caches use fewer shards so that no shard ends up empty
+    size_t active = max<size_t>(1, min(capacity, shards.size()));
+    if (active != active_shards) {
+      // words would move to other shards
+      for (auto &shard : shards)
+        clearShard(shard);
+      active_shards = active;
+    }
+    for (size_t i = 0; i < shards.size(); i++) {
+      auto &shard = shards[i];
+      // spread the capacity, the first shards taking the remainder
+      shard.capacity =
+          i < active ? capacity / active + (i < capacity % active ? 1 : 0)
+                     : 0;
+      while (shard.entries.size() > shard.capacity) {
+        evict(shard);
+      }
+    }
+    total_capacity = capacity;
+  }
+
+  bool get(const string &word, EncodedWord &encoded) {
+    return visit(word, [&encoded](const EncodedWord &e) { encoded = e; });
+  }
+
+  // calls f(encoded word) under the shard lock if `word` is cached, no copy
+  template <class F> bool visit(const string &word, F f) {
+    if (total_capacity == 0)
+      return false;
+    unique_lock<mutex> lock;
+    auto &shard = lockShard(word, lock);
+    auto it = shard.entries.find(word);
+    if (it == shard.entries.end()) {
+      misses++;
+      return false;
+    }
+    // move to the front of the LRU list
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second.pos);
+    f(it->second.encoded);
+    hits++;
+    return true;
+  }
+
+  void put(const string &word, const EncodedWord &encoded) {
+    if (total_capacity == 0)
+      return;
+    unique_lock<mutex> lock;
+    auto &shard = lockShard(word, lock);
+    if (shard.capacity == 0 || shard.entries.count(word) > 0)
+      return;
+    while (shard.entries.size() >= shard.capacity) {
+      evict(shard);
+    }
+    auto it = shard.entries.emplace(word, Entry()).first;
+    it->second.encoded = encoded;
+    shard.lru.push_front(&it->first);
+    it->second.pos = shard.lru.begin();
+  }
+
+  void clear() {
+    for (auto &shard : shards) {
+      lock_guard<mutex> lock(shard.m);
+      clearShard(shard);
+    }
+  }
+
+  size_t size() {
+    size_t n = 0;
+    for (auto &shard : shards) {
+      lock_guard<mutex> lock(shard.m);
+      n += shard.entries.size();
+    }
+    return n;
+  }
+
+  size_t capacity() const { return total_capacity; }
+
+  atomic<uint64_t> hits{0};
+  atomic<uint64_t> misses{0};
+  atomic<uint64_t> evictions{0};
+
+private:
+  struct Entry {
+    EncodedWord encoded;
+    // position of the word in the shard LRU list
+    list<const string *>::iterator pos;
+  };
+
+  struct Shard {
+    mutex m;
+    size_t capacity = 0;
+    // most recently used first, pointing to the keys of `entries`
+    list<const string *> lru;
+    unordered_map<string, Entry> entries;
+  };
+
+  /*
+      Locks and returns the shard of `word`. The shard count can only
+      change while every shard is locked, so it is checked again once the
+      shard is locked.
+  */
+  Shard &lockShard(const string &word, unique_lock<mutex> &lock) {
+    size_t h = hash<string>{}(word);
+    for (;;) {
+      size_t active = active_shards;
+      Shard &shard = shards[h % active];
+      lock = unique_lock<mutex>(shard.m);
+      if (active == active_shards)
+        return shard;
+      lock.unlock();
+    }
+  }
+
+  static void clearShard(Shard &shard) {
+    shard.lru.clear();
+    shard.entries.clear();
+  }
+
+  void evict(Shard &shard) {
+    shard.entries.erase(*shard.lru.back());
+    shard.lru.pop_back();
+    evictions++;
+  }
+
+  vector<Shard> shards;
+  atomic<size_t> active_shards{0};
+  atomic<size_t> total_capacity{0};
+};
+
+// ============================================================================
+// ============================== Model image =================================
+// ============================================================================
+
+/*
+    A model (codes and vocabulary) laid out as one read-only image used in
+    place: `fast compile` writes it to a file that encoders mmap, so loading
+    parses nothing and processes using the same model share its pages.
+    References inside the image are offsets from its start, so it can be
+    mapped at any address.
+
+    Sections, each aligned to 8 bytes:
+      header        ImageHeader
+      pool          bytes of every token and output token
+      tokens        ImageStr of each token id
+      token hash    open-addressing table of token ids
+      merges        open-addressing table of MergeSlot
+      infos         TokenInfo of each token id
+      outputs       ImageStr of each output token id, vocabulary first
+      counts        count of each vocabulary entry
+      output hash   open-addressing table of output token ids
+      restrictions  ImageStr of each token id, non-final then final, over
+                    the expansions
+      expansions    token ids each token is split into by the vocabulary
+*/
+
+const char kModelMagic[8] = {'f', 'a', 's', 't', 'B', 'P', 'E', '\0'};
+const uint32_t kModelVersion = 3;
+const uint32_t kEmptySlot = UINT32_MAX;
+
+// bytes [offset, offset + length) of the string pool
+struct ImageStr {
+  uint32_t offset, length;
+};
+
+// (left, right) -> (rank, merged token), with key = left << 32 | right
+struct MergeSlot {
+  uint64_t key;
+  uint32_t rank, merged;
+};
+
+/*
+    `left` and `right` are the tokens a token is merged from (kEmptySlot for
+    a char). `out_nonfinal` and `out_final` are the output ids of "x@@" and
+    of x without kEndWord, or -1 when they are not output tokens.
+*/
+struct TokenInfo {
+  uint32_t left, right;
+  int32_t out_nonfinal, out_final;
+};
+
+struct ImageHeader {
+  char magic[8];
+  uint32_t version, byte_order;
+  uint32_t num_tokens, num_merges, num_outputs, vocab_size;
+  uint32_t token_slots, merge_slots, output_slots, num_expansions;
+  // offsets of the sections, and size of the whole image
+  uint64_t pool, tokens, token_hash, merges, infos, outputs, counts,
+      output_hash, restrictions, expansions, size;
+};
+
+// power of two keeping a table of n entries at most half full
+uint32_t hashSlots(size_t n) {
+  uint32_t slots = 2;
+  while (slots < 2 * n)
+    slots <<= 1;
+  return slots;
+}
+
+uint64_t mergeKey(uint32_t left, uint32_t right) {
+  return uint64_t(left) << 32 | right;
+}
+
+class ModelImage {
+public:
+  ModelImage() {}
+  ModelImage(const ModelImage &) = delete;
+  ModelImage &operator=(const ModelImage &) = delete;
+  ~ModelImage() {
+    if (mapped != nullptr)
+      munmap(mapped, mapped_size);
+  }
+
+  // uses an image built in memory
+  void load(vector<uint64_t> &&image) {
+    owned = move(image);
+    attach((const char *)owned.data(), owned.size() * sizeof(uint64_t),
+           "memory");
+  }
+
+  // maps the image held by `fd`, read-only and shared
+  void map(int fd, const char *name) {
+    struct stat s;
+    if (fstat(fd, &s) < 0 || s.st_size < (off_t)sizeof(ImageHeader)) {
+      fprintf(stderr, "Invalid compiled model %s\n", name);
+      exit(EXIT_FAILURE);
+    }
+    mapped_size = s.st_size;
+    mapped = mmap(NULL, mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+      fprintf(stderr, "Compiled model memory map failed : %d.\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    attach((const char *)mapped, mapped_size, name);
+  }
+
+  // whether the file `fp` starts like a compiled model
+  static bool isImage(const char *fp) {
+    char magic[sizeof(kModelMagic)];
+    int fd = open(fp, O_RDONLY);
+    if (fd < 0)
+      return false;
+    bool is_image = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+                    memcmp(magic, kModelMagic, sizeof(magic)) == 0;
+    close(fd);
+    return is_image;
+  }
+
+  const ImageHeader &header() const { return *h; }
+  const char *data() const { return base; }
+
+  const char *str(const ImageStr &s) const { return base + h->pool + s.offset; }
+  const ImageStr &token(uint32_t id) const {
+    return section<ImageStr>(h->tokens)[id];
+  }
+  const ImageStr &output(uint32_t id) const {
+    return section<ImageStr>(h->outputs)[id];
+  }
+  const TokenInfo &info(uint32_t id) const {
+    return section<TokenInfo>(h->infos)[id];
+  }
+  uint32_t count(uint32_t id) const {
+    return section<uint32_t>(h->counts)[id];
+  }
+
+  /*
+      Tokens that token `id` becomes once limited to the vocabulary, as
+      [begin, end): itself if it is in the vocabulary, else the tokens it
+      was merged from, recursively.
+  */
+  pair<const uint32_t *, const uint32_t *> restrict(uint32_t id,
+                                                    bool isFinal) const {
+    auto &span = section<ImageStr>(h->restrictions)[2 * id + isFinal];
+    const uint32_t *begin = section<uint32_t>(h->expansions) + span.offset;
+    return make_pair(begin, begin + span.length);
+  }
+
+  // id of the token [p, p + n), kEmptySlot if there is none
+  uint32_t findToken(const char *p, size_t n) const {
+    return find(section<uint32_t>(h->token_hash), h->token_slots,
+                section<ImageStr>(h->tokens), p, n);
+  }
+
+  // id of the output token [p, p + n), -1 if there is none
+  int32_t findOutput(const char *p, size_t n) const {
+    uint32_t id = find(section<uint32_t>(h->output_hash), h->output_slots,
+                       section<ImageStr>(h->outputs), p, n);
+    return id == kEmptySlot ? -1 : int32_t(id);
+  }
+
+  const MergeSlot *findMerge(uint32_t left, uint32_t right) const {
+    const MergeSlot *slots = section<MergeSlot>(h->merges);
+    uint64_t key = mergeKey(left, right);
+    uint32_t mask = h->merge_slots - 1;
+    for (uint32_t i = hashKey(key) & mask;; i = (i + 1) & mask) {
+      if (slots[i].merged == kEmptySlot)
+        return nullptr;
+      if (slots[i].key == key)
+        return &slots[i];
+    }
+  }
+
+private:
+  void attach(const char *data, size_t size, const char *name) {
+    base = data;
+    h = (const ImageHeader *)data;
+    if (size < sizeof(ImageHeader) ||
+        memcmp(h->magic, kModelMagic, sizeof(kModelMagic)) != 0 ||
+        h->byte_order != kByteOrderMark || h->size > size) {
+      fprintf(stderr, "Invalid compiled model %s\n", name);
+      exit(EXIT_FAILURE);
+    }
+    if (h->version != kModelVersion) {
+      fprintf(stderr, "Compiled model %s has version %u, expected %u\n", name,
+              h->version, kModelVersion);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  template <class T> const T *section(uint64_t offset) const {
+    return (const T *)(base + offset);
+  }
+
+  uint32_t find(const uint32_t *table, uint32_t slots, const ImageStr *strs,
+                const char *p, size_t n) const {
+    uint32_t mask = slots - 1;
+    for (uint32_t i = hashBytes(p, n) & mask;; i = (i + 1) & mask) {
+      uint32_t id = table[i];
+      if (id == kEmptySlot)
+        return kEmptySlot;
+      if (strs[id].length == n && memcmp(str(strs[id]), p, n) == 0)
+        return id;
+    }
+  }
+
+  vector<uint64_t> owned;
+  void *mapped = nullptr;
+  size_t mapped_size = 0;
+  const char *base = nullptr;
+  const ImageHeader *h = nullptr;
+};
+
+/*
+    Builds the image of `codes` (pair -> rank) and of the vocabulary entries
+    `vocab`, in order. Token ids are given in rank order so they do not
+    depend on the hash map order of `codes`.
+*/
+vector<uint64_t> buildModelImage(const codesMap &codes,
+                                 const vector<pair<string, uint32_t>> &vocab) {
+  // a token is an int, it represents a string
+  unordered_map<string, uint32_t> token_to_id;
+  vector<string> tokens;
+  auto tokenId = [&](const string &token) {
+    auto it = token_to_id.emplace(token, tokens.size());
+    if (it.second)
+      tokens.push_back(token);
+    return it.first->second;
+  };
+  vector<pair<uint32_t, const tps *>> ranked;
+  for (auto &x : codes) {
+    ranked.emplace_back(x.second, &x.first);
+  }
+  sort(ranked.begin(), ranked.end());
+  vector<MergeSlot> merges;
+  for (auto &x : ranked) {
+    uint32_t left = tokenId(x.second->first);
+    uint32_t right = tokenId(x.second->second);
+    uint32_t merged = tokenId(x.second->first + x.second->second);
+    merges.push_back({mergeKey(left, right), x.first, merged});
+  }
+  vector<TokenInfo> infos(tokens.size(), {kEmptySlot, kEmptySlot, -1, -1});
+  for (auto &m : merges) {
+    auto &info = infos[m.merged];
+    if (info.left == kEmptySlot) {
+      info.left = m.key >> 32;
+      info.right = uint32_t(m.key);
+    }
+  }
+
+  /*
+      Output tokens are the vocabulary entries, in order, followed by the
+      tokens the codes can produce that are not in the vocabulary: "x@@" for
+      a token x not ending a word and "x" for a token "x</w>".
+  */
+  unordered_map<string, int32_t> output_to_id;
+  vector<string> outputs;
+  vector<uint32_t> counts;
+  auto addOutput = [&](const string &token) {
+    if (output_to_id.emplace(token, outputs.size()).second)
+      outputs.push_back(token);
+  };
+  for (auto &x : vocab) {
+    addOutput(x.first);
+    if (counts.size() < outputs.size())
+      counts.push_back(x.second);
+  }
+  uint32_t vocab_size = outputs.size();
+  auto isFinal = [](const string &token) {
+    size_t n = token.size();
+    return n >= kEndWordLength &&
+           token.compare(n - kEndWordLength, kEndWordLength, kEndWord) == 0;
+  };
+  for (auto &token : tokens) {
+    if (isFinal(token)) {
+      addOutput(token.substr(0, token.size() - kEndWordLength));
+    } else {
+      addOutput(token + kTokenDelim);
+    }
+  }
+  auto outputId = [&](const string &token) {
+    auto it = output_to_id.find(token);
+    return it != output_to_id.end() ? it->second : -1;
+  };
+  for (size_t t = 0; t < tokens.size(); t++) {
+    auto &token = tokens[t];
+    infos[t].out_nonfinal = outputId(token + kTokenDelim);
+    if (isFinal(token))
+      infos[t].out_final =
+          outputId(token.substr(0, token.size() - kEndWordLength));
+  }
+
+  // vocabulary restriction of every token, as a final token or not
+  auto inVocab = [&](uint32_t t, bool final) {
+    int32_t id = final ? infos[t].out_final : infos[t].out_nonfinal;
+    return id >= 0 && uint32_t(id) < vocab_size;
+  };
+  function<void(uint32_t, bool, vector<uint32_t> &)> decompose =
+      [&](uint32_t t, bool final, vector<uint32_t> &out) {
+        auto &info = infos[t];
+        if (info.left == kEmptySlot) {
+          // cannot be split further, it has to be a char
+          out.push_back(t);
+          return;
+        }
+        if (inVocab(info.left, false)) {
+          out.push_back(info.left);
+        } else {
+          decompose(info.left, false, out);
+        }
+        if (inVocab(info.right, final)) {
+          out.push_back(info.right);
+        } else {
+          decompose(info.right, final, out);
+        }
+      };
+  vector<ImageStr> restrictions;
+  vector<uint32_t> expansions;
+  if (vocab_size > 0) {
+    for (uint32_t t = 0; t < tokens.size(); t++) {
+      for (bool final : {false, true}) {
+        uint32_t begin = expansions.size();
+        if (inVocab(t, final)) {
+          expansions.push_back(t);
+        } else {
+          decompose(t, final, expansions);
+        }
+        restrictions.push_back({begin, uint32_t(expansions.size() - begin)});
+      }
+    }
+  }
+
+  // layout
+  ImageHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, kModelMagic, sizeof(kModelMagic));
+  h.version = kModelVersion;
+  h.byte_order = kByteOrderMark;
+  h.num_tokens = tokens.size();
+  h.num_merges = merges.size();
+  h.num_outputs = outputs.size();
+  h.vocab_size = vocab_size;
+  h.token_slots = hashSlots(tokens.size());
+  h.merge_slots = hashSlots(merges.size());
+  h.output_slots = hashSlots(outputs.size());
+  h.num_expansions = expansions.size();
+  uint64_t pool_size = 0;
+  for (auto &s : tokens)
+    pool_size += s.size();
+  for (auto &s : outputs)
+    pool_size += s.size();
+  if (pool_size > UINT32_MAX) {
+    fprintf(stderr, "Model too large to be compiled.\n");
+    exit(EXIT_FAILURE);
+  }
+  uint64_t offset = 0;
+  auto place = [&offset](uint64_t size) {
+    uint64_t start = offset;
+    offset = (offset + size + 7) & ~uint64_t(7);
+    return start;
+  };
+  place(sizeof(ImageHeader));
+  h.pool = place(pool_size);
+  h.tokens = place(tokens.size() * sizeof(ImageStr));
+  h.token_hash = place(h.token_slots * sizeof(uint32_t));
+  h.merges = place(h.merge_slots * sizeof(MergeSlot));
+  h.infos = place(infos.size() * sizeof(TokenInfo));
+  h.outputs = place(outputs.size() * sizeof(ImageStr));
+  h.counts = place(counts.size() * sizeof(uint32_t));
+  h.output_hash = place(h.output_slots * sizeof(uint32_t));
+  h.restrictions = place(restrictions.size() * sizeof(ImageStr));
+  h.expansions = place(expansions.size() * sizeof(uint32_t));
+  h.size = offset;
+
+  vector<uint64_t> image(h.size / sizeof(uint64_t));
+  char *base = (char *)image.data();
+  memcpy(base, &h, sizeof(h));
+  uint32_t pool_offset = 0;
+  auto addStrings = [&](const vector<string> &strs, uint64_t at,
+                        uint64_t table, uint32_t slots) {
+    auto *spans = (ImageStr *)(base + at);
+    auto *hash = (uint32_t *)(base + table);
+    fill(hash, hash + slots, kEmptySlot);
+    for (size_t i = 0; i < strs.size(); i++) {
+      memcpy(base + h.pool + pool_offset, strs[i].data(), strs[i].size());
+      spans[i] = {pool_offset, uint32_t(strs[i].size())};
+      pool_offset += strs[i].size();
+      uint32_t mask = slots - 1;
+      uint32_t j = hashBytes(strs[i].data(), strs[i].size()) & mask;
+      while (hash[j] != kEmptySlot)
+        j = (j + 1) & mask;
+      hash[j] = i;
+    }
+  };
+  addStrings(tokens, h.tokens, h.token_hash, h.token_slots);
+  addStrings(outputs, h.outputs, h.output_hash, h.output_slots);
+  auto *merge_slots = (MergeSlot *)(base + h.merges);
+  fill(merge_slots, merge_slots + h.merge_slots,
+       MergeSlot{0, kEmptySlot, kEmptySlot});
+  for (auto &m : merges) {
+    uint32_t mask = h.merge_slots - 1;
+    uint32_t j = hashKey(m.key) & mask;
+    while (merge_slots[j].merged != kEmptySlot)
+      j = (j + 1) & mask;
+    merge_slots[j] = m;
+  }
+  memcpy(base + h.infos, infos.data(), infos.size() * sizeof(TokenInfo));
+  memcpy(base + h.counts, counts.data(), counts.size() * sizeof(uint32_t));
+  memcpy(base + h.restrictions, restrictions.data(),
+         restrictions.size() * sizeof(ImageStr));
+  memcpy(base + h.expansions, expansions.data(),
+         expansions.size() * sizeof(uint32_t));
+  return image;
 }
 
-void readCodes(const char *fp, codesMap &codes,
-               reverseCodesMap &reversed_codes) {
-  ifstream file(fp);
-  if (!file) {
-    fprintf(stderr, "Cannot open codes file %s\n", fp);
+// reads a codes file and an optional vocabulary file into a model image
+vector<uint64_t> compileModel(const string &codesPath,
+                              const string &vocabPath) {
+  vector<pair<string, uint32_t>> vocab;
+  if (vocabPath != "") {
+    wMapCounts counts;
+    vector<string> order;
+    readVocab(vocabPath.c_str(), counts, &order);
+    for (auto &word : order) {
+      vocab.emplace_back(word, counts[word]);
+    }
+  }
+  codesMap codes;
+  reverseCodesMap reversed_codes;
+  readCodes(codesPath.c_str(), codes, reversed_codes);
+  return buildModelImage(codes, vocab);
+}
+
+/*
+    Compiles a model into an anonymous sealed memory file and returns its
+    descriptor. Processes forked after this (or given the descriptor) map
+    the same read-only pages, none of them holding a private copy.
+*/
+int compileToMemfd(const char *codesPath, const char *vocabPath) {
+  auto image = compileModel(codesPath, vocabPath);
+  auto &h = *(const ImageHeader *)image.data();
+  int fd = memfd_create("fastbpe-model", MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot create a memory file for the model : %d.\n",
+            errno);
     exit(EXIT_FAILURE);
   }
-  fprintf(stderr, "Loading codes from %s ...\n", fp);
-  string line;
-  while (getline(file, line)) {
-    vector<string> splits;
-    split(splits, line, ' ');
-    assert(splits.size() == 3);
-    auto pair = make_pair(splits[0], splits[1]);
-    string concat = splits[0] + splits[1];
-    assert(codes.find(pair) == codes.end());
-    assert(reversed_codes.find(concat) == reversed_codes.end());
-    codes[pair] = codes.size();
-    reversed_codes[concat] = pair;
+  safePwrite(fd, (const char *)image.data(), h.size, 0, "memfd");
+  if (fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+    fprintf(stderr, "Cannot seal the model memory file : %d.\n", errno);
+    exit(EXIT_FAILURE);
   }
-  fprintf(stderr, "Read %lu codes from the codes file.\n", codes.size());
+  return fd;
 }
 
-void decompose(const string s, vector<string> &newSubwords,
-               const reverseCodesMap &reversed_codes,
-               const wMapCounts &vocab, bool isFinal) {
-  auto it = reversed_codes.find(s);
-  if (it == reversed_codes.end()) {
-    // TODO this whole block below is just some sanity check
-    // if we cannot un-merge a subword, it has to be a char
-    string s2 = isFinal ? s.substr(0, s.size() - kEndWordLength) : s;
-    int count = 0;
-    for (int j = 0; j < s2.size(); j++) {
-      if ((s2[j] & 0xc0) != 0x80) {
-        count++;
+void compile(const char *outputFile, const char *codesPath,
+             const char *vocabPath) {
+  auto image = compileModel(codesPath, vocabPath);
+  auto &h = *(const ImageHeader *)image.data();
+  int fd = safeOpen(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  safePwrite(fd, (const char *)image.data(), h.size, 0, outputFile);
+  close(fd);
+  fprintf(stderr,
+          "Wrote %u codes and %u vocabulary entries to %s (%lu bytes).\n",
+          h.num_merges, h.vocab_size, outputFile, h.size);
+}
+
+// ============================================================================
+// ============================== BPE Encoder =================================
+// ============================================================================
+
+/*
+    Holds the codes and vocabulary already converted to their C++ form so
+    they can be reused across many `encode` calls instead of being rebuilt
+    from python dicts (or re-read from disk) on every call.
+
+    Codes are kept in a ModelImage as integer token ids: every merge operand
+    and result is given an id once, and merges are looked up in a
+    (left, right) -> (rank, merged id) table. A compiled model is mapped as
+    it is; codes and vocabulary text files are converted to an image first.
+*/
+class Encoder {
+public:
+  static const uint32_t kUnknown = UINT32_MAX;
+  // output tokens missing from the token table in EncodedWord::ids, given
+  // out as unkId()
+  static const int32_t kUnknownId = -1;
+
+  Encoder(const string &codesPath, const string &vocabPath = "",
+          size_t cacheSize = kDefaultCacheSize)
+      : cache(cacheSize) {
+    if (ModelImage::isImage(codesPath.c_str())) {
+      if (vocabPath != "")
+        fprintf(stderr, "The vocabulary is part of compiled model %s, "
+                        "ignoring %s\n",
+                codesPath.c_str(), vocabPath.c_str());
+      int fd = safeOpen(codesPath.c_str(), O_RDONLY);
+      model.map(fd, codesPath.c_str());
+      close(fd);
+      fprintf(stderr, "Loaded %u codes and %u vocabulary entries from %s.\n",
+              model.header().num_merges, model.header().vocab_size,
+              codesPath.c_str());
+      return;
+    }
+    model.load(compileModel(codesPath, vocabPath));
+  }
+
+  // compiled model held by `fd`, which can be closed afterwards
+  explicit Encoder(int fd, size_t cacheSize = kDefaultCacheSize)
+      : cache(cacheSize) {
+    string name = "descriptor " + to_string(fd);
+    model.map(fd, name.c_str());
+  }
+
+  Encoder(const codesMap &codes, const wMapCounts &vocab,
+          size_t cacheSize = kDefaultCacheSize)
+      : cache(cacheSize) {
+    // no file order here, sort the vocab like getvocab does
+    vector<pair<string, uint32_t>> sorted_vocab(vocab.begin(), vocab.end());
+    sort(sorted_vocab.begin(), sorted_vocab.end(), byCount);
+    model.load(buildModelImage(codes, sorted_vocab));
+  }
+
+  // BPE string and token ids of a single word
+  EncodedWord encodeWord(const string &word) const {
+    // merge subWords as much as possible
+    const string w = word + kEndWord;
+    vector<Piece> pieces;
+    StatTimer bpe_timer(Stats::kBpeNs);
+    size_t chars = mergeWord(w, pieces);
+    bpe_timer.stop();
+    if (statsOn()) {
+      Stats::instance().add(Stats::kEncodedWords, 1);
+      Stats::instance().add(Stats::kMerges, chars - pieces.size());
+    }
+    // check that we are only using words in the dictionary
+    // (precomputed for every token, unknown chars are kept as they are)
+    if (model.header().vocab_size > 0) {
+      StatTimer limit_timer(Stats::kLimitVocabNs);
+      vector<Piece> limited;
+      for (size_t i = 0; i < pieces.size(); i++) {
+        if (pieces[i].id == kUnknown) {
+          limited.push_back(pieces[i]);
+          continue;
+        }
+        auto span = model.restrict(pieces[i].id, i + 1 == pieces.size());
+        for (auto t = span.first; t != span.second; t++) {
+          limited.push_back(tokenPiece(*t));
+        }
       }
+      pieces.swap(limited);
     }
-    assert(count == 1);
-    newSubwords.push_back(s);
-    return;
+    // concat subWords, dropping the "</w>" of the last one
+    EncodedWord encoded;
+    for (size_t i = 0; i < pieces.size(); i++) {
+      auto &piece = pieces[i];
+      bool isFinal = i + 1 == pieces.size();
+      if (!isFinal) {
+        encoded.bpe.append(piece.p, piece.n);
+        encoded.bpe += kTokenDelim;
+        encoded.bpe += ' ';
+      } else {
+        encoded.bpe.append(piece.p, piece.n - kEndWordLength);
+      }
+      encoded.ids.push_back(outputId(piece, isFinal));
+    }
+    return encoded;
   }
-  assert(it != reversed_codes.end());
-  string token1 = it->second.first;
-  if (vocab.find(token1 + kTokenDelim) == vocab.end()) {
-    decompose(token1, newSubwords, reversed_codes, vocab, false);
-  } else {
-    newSubwords.push_back(token1);
+
+  // encodes every word of `words`, in parallel
+  vector<EncodedWord> encodeWords(const StringArena &words) const {
+    if (statsOn()) {
+      Stats::instance().add(Stats::kDistinctWords, words.size());
+      Stats::instance().setMax(Stats::kPeakDistinctWords, words.size());
+    }
+    vector<EncodedWord> encoded(words.size());
+    ThreadPool::instance().parallelFor(
+        words.size(), 64, [&](size_t begin, size_t end) {
+          for (size_t w = begin; w < end; w++) {
+            encoded[w] = cachedWord(words.str(w));
+          }
+        });
+    return encoded;
   }
-  string token2 = it->second.second;
-  auto query = token2 + kTokenDelim;
-  if (isFinal) {
-    query = token2.substr(0, token2.size() - kEndWordLength);
+
+  // BPE string of every word of `words`
+  BpeTable buildBpes(StringArena &&words) const {
+    BpeTable table;
+    table.words = move(words);
+    // apply BPE codes to each word
+    vector<EncodedWord> encoded = encodeWords(table.words);
+    // build final BPE codes
+    table.offsets.reserve(encoded.size() + 1);
+    table.offsets.push_back(0);
+    for (auto &x : encoded) {
+      table.bpe.insert(table.bpe.end(), x.bpe.begin(), x.bpe.end());
+      table.offsets.push_back(table.bpe.size());
+      vector<int32_t>().swap(x.ids);
+      string().swap(x.bpe);
+    }
+    return table;
   }
-  if (vocab.find(query) == vocab.end()) {
-    decompose(token2, newSubwords, reversed_codes, vocab, isFinal);
-  } else {
-    newSubwords.push_back(token2);
+
+
+  string encode(const string &text) const {
+    // pad the input string
+    string text_ = text; // make a copy that can be modified
+    padText(text_);
+    // read input text words
+    StringArena words;
+    readString(text_, words, false);
+    // apply BPE
+    auto final_bpe = buildBpes(move(words));
+    return outputString(text_, final_bpe);
   }
-}
 
-void limitVocab(const vector<string> &subwords, vector<string> &newSubwords,
-                const reverseCodesMap &reversed_codes,
-                const wMapCounts &vocab) {
-  string query;
-  for (int i = 0; i < subwords.size(); i++) {
-    bool isFinal = i == subwords.size() - 1;
-    auto &subword = subwords[i];
-    if (isFinal) {
-      query = subword.substr(0, subword.size() - kEndWordLength);
-    } else {
-      query = subword + kTokenDelim;
+  /*
+      Appends the BPE of [begin, end) to `out`, separators being copied as
+      they are, and returns the number of words. As appendBpe, a last word
+      not followed by a separator is not written. Words go through the
+      cache, and are appended straight from it.
+  */
+  uint64_t encodeTo(const char *begin, const char *end, string &out) const {
+    uint64_t total = 0;
+    size_t out_size = out.size();
+    string cur_word;
+    auto append = [&out](const EncodedWord &encoded) { out += encoded.bpe; };
+    forEachSpan(begin, end, [&](const char *b, const char *e, char sep) {
+      if (sep == 0)
+        return;
+      if (b != e) {
+        cur_word.assign(b, e);
+        withCachedWord(cur_word, append);
+        total++;
+      }
+      out.push_back(sep);
+    });
+    if (statsOn()) {
+      auto &stats = Stats::instance();
+      stats.add(Stats::kWords, total);
+      stats.add(Stats::kBytesIn, end - begin);
+      stats.add(Stats::kBytesOut, out.size() - out_size);
     }
-    if (vocab.find(query) == vocab.end()) {
-      decompose(subword, newSubwords, reversed_codes, vocab, isFinal);
-    } else {
-      newSubwords.push_back(subword);
-    }
-  }
-}
-
-string process_bpe(vector<string> &subwords,
-                   codesMap &codes,
-                   reverseCodesMap &reversed_codes,
-                   wMapCounts &vocab) {
-  // merge subWords as much as possible
-  vector<string> newSubwords;
-  while (subwords.size() > 1) {
-    // find the best pair
-    int bestPairId = -1;
-    auto bestPair = codes.end(); // TODO ugly hack that works
-    for (int i = 0; i < subwords.size() - 1; i++) {
-      auto pair = make_pair(subwords[i], subwords[i + 1]);
-      auto it = codes.find(pair);
-      int pairRank = it == codes.end() ? -1 : it->second;
-      if (pairRank >= 0 && (bestPairId == -1 || bestPair->second > pairRank)) {
-        bestPair = it;
-        bestPairId = i;
+    return total;
+  }
+
+  // encoded word, going through the cache
+  EncodedWord cachedWord(const string &word) const {
+    EncodedWord encoded;
+    withCachedWord(word, [&encoded](const EncodedWord &e) { encoded = e; });
+    return encoded;
+  }
+
+  // calls f(encoded word), from the cache entry when there is one
+  template <class F> void withCachedWord(const string &word, F f) const {
+    bool hit = cache.visit(word, f);
+    if (!hit) {
+      EncodedWord encoded = encodeWord(word);
+      cache.put(word, encoded);
+      f(encoded);
+    }
+    if (statsOn())
+      Stats::instance().add(hit ? Stats::kCacheHits : Stats::kCacheMisses, 1);
+  }
+
+  /*
+      Fills the cache with the `n` most frequent words of the vocabulary
+      (BPE tokens ending with kTokenDelim are not words and are skipped).
+      Returns the number of words added.
+  */
+  size_t warmup(size_t n) const {
+    vector<pair<string, uint32_t>> words;
+    for (uint32_t i = 0; i < model.header().vocab_size; i++) {
+      auto &s = model.output(i);
+      const char *w = model.str(s);
+      if (s.length >= kTokenDelimLength &&
+          memcmp(w + s.length - kTokenDelimLength, kTokenDelim,
+                 kTokenDelimLength) == 0)
+        continue;
+      words.emplace_back(string(w, s.length), model.count(i));
+    }
+    n = min(n, min(words.size(), cache.capacity()));
+    partial_sort(words.begin(), words.begin() + n, words.end(), byCount);
+    for (size_t i = 0; i < n; i++) {
+      cache.put(words[i].first, encodeWord(words[i].first));
+    }
+    return n;
+  }
+
+  /*
+      Encodes several texts at once: words are deduplicated across the whole
+      batch and each distinct word is segmented once.
+  */
+  vector<string> encodeBatch(const vector<string> &texts) const {
+    vector<string> texts_(texts);
+    StringArena words;
+    for (auto &text : texts_) {
+      padText(text);
+      readString(text, words, false);
+    }
+    auto final_bpe = buildBpes(move(words));
+    vector<string> results(texts_.size());
+    ThreadPool::instance().parallelFor(
+        texts_.size(), 16, [&](size_t begin, size_t end) {
+          for (size_t i = begin; i < end; i++) {
+            results[i] = outputString(texts_[i], final_bpe);
+          }
+        });
+    return results;
+  }
+
+  /*
+      Encodes several texts straight to token ids: the ids of text `i` are
+      ids[offsets[i], offsets[i + 1]). Tokens missing from the token table
+      get unkId(). With `starts` and `ends`, the token ids[j] also spans
+      the bytes [starts[j], ends[j]) of its text (without kTokenDelim), and
+      with `tokens` its string is tokens[j], even for unknown tokens.
+  */
+  void encodeIds(const vector<string> &texts, vector<int32_t> &ids,
+                 vector<int64_t> &offsets, vector<int64_t> *starts = nullptr,
+                 vector<int64_t> *ends = nullptr,
+                 vector<string> *tokens = nullptr) const {
+    // distinct words of the whole batch
+    StringArena words;
+    for (auto &text : texts) {
+      forEachWord(text, [&](const char *begin, const char *end) {
+        words.intern(begin, end - begin);
+      });
+    }
+    vector<EncodedWord> encoded = encodeWords(words);
+
+    offsets.assign(1, 0);
+    uint64_t total = 0, bytes = 0;
+    const int32_t unk = unkId();
+    for (auto &text : texts) {
+      forEachWord(text, [&](const char *begin, const char *end) {
+        auto &word = encoded[words.find(begin, end - begin)];
+        for (int32_t id : word.ids)
+          ids.push_back(id != kUnknownId ? id : unk);
+        if (starts != nullptr)
+          appendSpans(word, begin - text.data(), *starts, *ends, tokens);
+        total++;
+      });
+      offsets.push_back(ids.size());
+      bytes += text.size();
+    }
+    if (statsOn()) {
+      auto &stats = Stats::instance();
+      stats.add(Stats::kWords, total);
+      stats.add(Stats::kBytesIn, bytes);
+      stats.add(Stats::kBytesOut, ids.size() * sizeof(int32_t));
+    }
+  }
+
+  // output tokens, indexed by their id
+  vector<string> tokenTable() const {
+    vector<string> tokens;
+    for (uint32_t i = 0; i < model.header().num_outputs; i++) {
+      auto &s = model.output(i);
+      tokens.emplace_back(model.str(s), s.length);
+    }
+    return tokens;
+  }
+
+  int32_t tokenId(const string &token) const {
+    int32_t id = model.findOutput(token.data(), token.size());
+    return id != kUnknownId ? id : unkId();
+  }
+
+  /*
+      Id given to the tokens missing from the token table: by default the
+      size of the table, which no token has, or any id set with setUnkId
+      (such as the id of an "<unk>" vocabulary entry). Set it before
+      encoding, it is not synchronized.
+  */
+  int32_t unkId() const {
+    return unk_id >= 0 ? unk_id : int32_t(model.header().num_outputs);
+  }
+  void setUnkId(int32_t id) { unk_id = id; }
+
+  /*
+      Appends the text of the output tokens `ids` to `out`: "x@@" tokens
+      are joined to the next one, words are separated by a space. Ids
+      outside the token table (such as the default unkId) are skipped, the
+      text of unknown tokens is lost.
+  */
+  void decodeIds(const int32_t *ids, size_t n, string &out) const {
+    const uint32_t num_outputs = model.header().num_outputs;
+    bool joined = true;
+    for (size_t i = 0; i < n; i++) {
+      if (ids[i] < 0 || uint32_t(ids[i]) >= num_outputs)
+        continue;
+      auto &s = model.output(ids[i]);
+      const char *token = model.str(s);
+      if (!joined)
+        out.push_back(' ');
+      joined = s.length >= kTokenDelimLength &&
+               memcmp(token + s.length - kTokenDelimLength, kTokenDelim,
+                      kTokenDelimLength) == 0;
+      out.append(token, joined ? s.length - kTokenDelimLength : s.length);
+    }
+  }
+
+  // text of every sequence ids[offsets[i], offsets[i + 1]), in parallel
+  vector<string> decodeIdsBatch(const int32_t *ids, const int64_t *offsets,
+                                size_t n) const {
+    vector<string> texts(n);
+    ThreadPool::instance().parallelFor(n, 16, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        decodeIds(ids + offsets[i], offsets[i + 1] - offsets[i], texts[i]);
       }
+    });
+    return texts;
+  }
+
+  size_t numCodes() const { return model.header().num_merges; }
+  size_t vocabSize() const { return model.header().vocab_size; }
+  const ModelImage &getModel() const { return model; }
+  BpeCache &getCache() const { return cache; }
+
+private:
+  // a subword: a token (or an unknown char, id kUnknown) and its bytes
+  struct Piece {
+    uint32_t id;
+    const char *p;
+    size_t n;
+  };
+
+  /*
+      Byte spans of the subwords of `word`, which starts at `start`, and
+      their tokens if `tokens` is given: the subwords of its BPE string are
+      separated by spaces, all but the last one ending with kTokenDelim.
+  */
+  static void appendSpans(const EncodedWord &word, int64_t start,
+                          vector<int64_t> &starts, vector<int64_t> &ends,
+                          vector<string> *tokens) {
+    const char *p = word.bpe.data(), *end = p + word.bpe.size();
+    while (p < end) {
+      const char *space = (const char *)memchr(p, ' ', end - p);
+      size_t n = space == nullptr ? end - p : space - p - kTokenDelimLength;
+      if (tokens != nullptr)
+        tokens->emplace_back(p, space == nullptr ? end : space);
+      starts.push_back(start);
+      ends.push_back(start + n);
+      start += n;
+      p = space == nullptr ? end : space + 1;
     }
-    // if we cannot merge anything, stop
-    if (bestPairId == -1) {
-      break;
+  }
+
+  Piece tokenPiece(uint32_t id) const {
+    auto &s = model.token(id);
+    return {id, model.str(s), s.length};
+  }
+
+  // output id of `piece`, rendered as "x@@" or as final x
+  int32_t outputId(const Piece &piece, bool isFinal) const {
+    if (piece.id != kUnknown) {
+      auto &info = model.info(piece.id);
+      return isFinal ? info.out_final : info.out_nonfinal;
+    }
+    if (isFinal)
+      return model.findOutput(piece.p, piece.n - kEndWordLength);
+    string token(piece.p, piece.n);
+    token += kTokenDelim;
+    return model.findOutput(token.data(), token.size());
+  }
+
+  static bool byCount(const pair<string, uint32_t> &a,
+                      const pair<string, uint32_t> &b) {
+    return a.second > b.second || (a.second == b.second && a.first < b.first);
+  }
+
+  // calls f(begin, end) for every word of `text`
+  template <class F> static void forEachWord(const string &text, F f) {
+    forEachSpan(text.data(), text.data() + text.size(),
+                [&f](const char *b, const char *e, char) {
+                  if (b != e)
+                    f(b, e);
+                });
+  }
+
+  /*
+      Calls f(begin, end, sep) for every (possibly empty) word of
+      [begin, end) followed by its separator, sep being 0 for the last one.
+  */
+  template <class F>
+  static void forEachSpan(const char *p, const char *end, F f) {
+    const char *start = p;
+    forEachSeparator(p, end - p, [&](size_t i) {
+      f(start, p + i, p[i]);
+      start = p + i + 1;
+    });
+    if (end != start)
+      f(start, end, 0);
+  }
+
+  /*
+      Applies the merges to `w`, a word followed by kEndWord, gives its
+      subwords, the last one ending with kEndWord, and returns its number
+      of chars. Symbols are byte ranges of `w` linked in a list; candidate
+      pairs sit in a min-heap ordered by rank and then by position, so
+      pairs are merged lowest rank first and left to right, as when merging
+      every occurrence of the best pair in turn.
+  */
+  size_t mergeWord(const string &w, vector<Piece> &subwords) const {
+    const size_t word_size = w.size() - kEndWordLength;
+    if (word_size == 0) {
+      subwords.push_back({model.findToken(w.data(), w.size()), w.data(),
+                          w.size()});
+      return 1;
+    }
+    struct Symbol {
+      uint32_t id, start, end;
+      int32_t prev, next;
+    };
+    vector<Symbol> symbols;
+    size_t start = 0;
+    auto push_symbol = [&](size_t end) {
+      int32_t i = symbols.size();
+      symbols.push_back({model.findToken(w.data() + start, end - start),
+                         uint32_t(start), uint32_t(end), i - 1, i + 1});
+      start = end;
+    };
+    // a symbol per char, the last one with kEndWord
+    forEachCharStart(w.data(), word_size, [&](size_t pos) {
+      if (pos > 0)
+        push_symbol(pos);
+    });
+    push_symbol(w.size());
+    symbols.back().next = -1;
+
+    // (rank, position of the left symbol, left id, right id)
+    using candidate = tuple<uint32_t, int32_t, uint32_t, uint32_t>;
+    priority_queue<candidate, vector<candidate>, greater<candidate>> queue;
+    auto push_pair = [&](int32_t i) {
+      if (i < 0 || symbols[i].next < 0)
+        return;
+      uint32_t left = symbols[i].id, right = symbols[symbols[i].next].id;
+      if (left == kUnknown || right == kUnknown)
+        return;
+      auto merge = model.findMerge(left, right);
+      if (merge != nullptr)
+        queue.emplace(merge->rank, i, left, right);
+    };
+    for (int32_t i = 0; i + 1 < int32_t(symbols.size()); i++) {
+      push_pair(i);
+    }
+
+    while (!queue.empty()) {
+      uint32_t rank, left, right;
+      int32_t i;
+      tie(rank, i, left, right) = queue.top();
+      queue.pop();
+      auto &sym = symbols[i];
+      // skip pairs that changed since they were queued
+      if (sym.id != left || sym.next < 0 || symbols[sym.next].id != right)
+        continue;
+      auto &next = symbols[sym.next];
+      sym.id = model.findMerge(left, right)->merged;
+      sym.end = next.end;
+      next.id = kUnknown;
+      sym.next = next.next;
+      if (sym.next >= 0)
+        symbols[sym.next].prev = i;
+      push_pair(sym.prev);
+      push_pair(i);
     }
-    // otherwise, merge subWords
-    bool justMerged = false;
-    newSubwords = vector<string>();
-    for (int i = 0; i < subwords.size(); i++) {
-      if ((i + 1 < subwords.size()) && (not justMerged) &&
-          subwords[i] == bestPair->first.first &&
-          subwords[i + 1] == bestPair->first.second) {
-        newSubwords.push_back(subwords[i] + subwords[i + 1]);
-        justMerged = true;
+
+    for (int32_t i = 0; i >= 0; i = symbols[i].next) {
+      auto &sym = symbols[i];
+      if (sym.id != kUnknown) {
+        subwords.push_back(tokenPiece(sym.id));
       } else {
-        if (not justMerged) {
-          newSubwords.push_back(subwords[i]);
+        subwords.push_back({kUnknown, w.data() + sym.start,
+                            size_t(sym.end - sym.start)});
+      }
+    }
+    return symbols.size();
+  }
+
+  ModelImage model;
+  mutable BpeCache cache;
+  // negative for the size of the token table
+  int32_t unk_id = -1;
+};
+
+// reads up to `size` bytes, returns 0 at the end of the input
+size_t safeRead(int fd, char *buf, size_t size, const char *fp) {
+  while (true) {
+    ssize_t n = read(fd, buf, size);
+    if (n >= 0)
+      return n;
+    if (errno != EINTR) {
+      fprintf(stderr, "Couldn't read from input file %s : %d.\n", fp, errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/*
+    Streaming applybpe, for stdin, pipes and unbounded inputs. Blocks of
+    whole words are encoded on the thread pool as soon as they are read and
+    written back in input order, a last word with no separator after it
+    being dropped as in applybpe. Memory is bounded by the encoder cache and
+    the at most kStreamDepth blocks in flight, instead of every distinct
+    word of the input.
+*/
+void applybpeStream(const char *outputFile, const char *inputFile,
+                    const Encoder &encoder) {
+  const size_t kStreamBlock = 1 << 20;
+  auto &pool = ThreadPool::instance();
+  const size_t kStreamDepth = 2 * pool.size() + 2;
+
+  bool stdIn = strcmp(inputFile, "-") == 0;
+  bool stdOut = strcmp(outputFile, "-") == 0;
+  int fd = stdIn ? STDIN_FILENO : safeOpen(inputFile, O_RDONLY);
+  int fdOut = stdOut ? STDOUT_FILENO
+                     : safeOpen(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  fprintf(stderr, "Applying BPE to %s ...\n", inputFile);
+
+  struct Block {
+    string in, out;
+    uint64_t words = 0;
+    bool done = false;
+  };
+  mutex m;
+  condition_variable cv;
+  deque<unique_ptr<Block>> in_flight;
+  uint64_t total = 0;
+
+  // writes the first block once encoded, waiting for it if `wait`
+  auto writeFront = [&](bool wait) {
+    Block &block = *in_flight.front();
+    {
+      unique_lock<mutex> lock(m);
+      if (!block.done && !wait)
+        return false;
+      cv.wait(lock, [&block]() { return block.done; });
+    }
+    safeWrite(fdOut, block.out.data(), block.out.size(), outputFile);
+    total += block.words;
+    in_flight.pop_front();
+    return true;
+  };
+
+  string carry;
+  bool eof = false;
+  while (!eof) {
+    // read until the block holds at least one full word, blocks being cut
+    // after their last separator
+    unique_ptr<Block> block(new Block());
+    block->in.swap(carry);
+    size_t last = string::npos;
+    while (last == string::npos) {
+      size_t have = block->in.size();
+      // grows geometrically when a word is longer than a block
+      block->in.resize(max(2 * have, kStreamBlock));
+      size_t n = safeRead(fd, &block->in[have], block->in.size() - have,
+                          inputFile);
+      block->in.resize(have + n);
+      if (n == 0) {
+        eof = true;
+        break;
+      }
+      // only the bytes just read can hold a separator
+      for (size_t i = have + n; i > have; i--) {
+        char c = block->in[i - 1];
+        if (c == ' ' || c == '\n') {
+          last = i - 1;
+          break;
+        }
+      }
+    }
+    if (last != string::npos) {
+      carry.assign(block->in, last + 1, string::npos);
+      block->in.resize(last + 1);
+    }
+    if (block->in.empty())
+      continue;
+
+    Block *b = block.get();
+    in_flight.push_back(move(block));
+    pool.async([b, &encoder, &m, &cv]() {
+      b->out.reserve(b->in.size() * 2);
+      uint64_t words = encoder.encodeTo(b->in.data(),
+                                        b->in.data() + b->in.size(), b->out);
+      string().swap(b->in);
+      lock_guard<mutex> lock(m);
+      b->words = words;
+      b->done = true;
+      cv.notify_all();
+    });
+
+    // write what is ready, and wait when too many blocks are in flight
+    while (!in_flight.empty() && writeFront(in_flight.size() >= kStreamDepth))
+      ;
+  }
+  while (!in_flight.empty())
+    writeFront(true);
+
+  fprintf(stderr, "Modified %lu words from text file.\n", total);
+  if (!stdOut)
+    close(fdOut);
+  if (!stdIn)
+    close(fd);
+}
+
+bool isRegularFile(const char *fp) {
+  struct stat s;
+  return strcmp(fp, "-") != 0 && stat(fp, &s) == 0 && S_ISREG(s.st_mode);
+}
+
+void applybpe(const char *outputFile, const char *inputFile,
+              const char *codesPath, const char *vocabPath) {
+  if (!isRegularFile(inputFile) || strcmp(outputFile, "-") == 0) {
+    // words are seen as they come: the cache avoids encoding them again
+    Encoder encoder(codesPath, vocabPath, kStreamCacheSize);
+    applybpeStream(outputFile, inputFile, encoder);
+    return;
+  }
+  // read input file words
+  StringArena words;
+  readWords(inputFile, words);
+  // apply BPE
+  // every distinct word is encoded only once, no need for a cache
+  Encoder encoder(codesPath, vocabPath, 0);
+  auto final_bpe = encoder.buildBpes(move(words));
+  // output
+  outputText(outputFile, inputFile, final_bpe);
+}
+
+// ============================================================================
+// ============================== BPE decoder =================================
+// ============================================================================
+
+/*
+    Joins the subwords of the BPE encoded text [p, p + n) in place, and
+    returns its decoded size. kTokenDelim is removed when followed by a
+    space (which goes too), by a new line or by the end of the text, as
+    `sed -r 's/(@@ )|(@@ ?$)//g'` does. Text is only moved after the first
+    delimiter, and delimiters are found with memchr.
+*/
+size_t decodeBpe(char *p, size_t n) {
+  const char *in = p, *end = p + n;
+  char *out = p;
+  const char *at = in;
+  while ((at = (const char *)memchr(at, kTokenDelim[0], end - at))) {
+    const char *next = at + kTokenDelimLength;
+    if (next > end || memcmp(at, kTokenDelim, kTokenDelimLength) != 0 ||
+        (next < end && *next != ' ' && *next != '\n')) {
+      at++;
+      continue;
+    }
+    if (out != in)
+      memmove(out, in, at - in);
+    out += at - in;
+    in = next < end && *next == ' ' ? next + 1 : next;
+    at = in;
+  }
+  if (out != in)
+    memmove(out, in, end - in);
+  return out + (end - in) - p;
+}
+
+string decode(const string &text) {
+  string decoded(text);
+  decoded.resize(decodeBpe(&decoded[0], decoded.size()));
+  return decoded;
+}
+
+vector<string> decodeBatch(const vector<string> &texts) {
+  vector<string> decoded(texts.size());
+  ThreadPool::instance().parallelFor(
+      texts.size(), 64, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          decoded[i] = decode(texts[i]);
         }
-        justMerged = false;
+      });
+  return decoded;
+}
+
+/*
+    Removes the BPE of a text file, or of stdin / to stdout with `-`. The
+    input is read in blocks of whole lines decoded in place, so it streams
+    in bounded memory, a pass over each byte being all the work done.
+*/
+void unbpe(const char *outputFile, const char *inputFile) {
+  const size_t kBlock = 4 << 20;
+  bool stdIn = strcmp(inputFile, "-") == 0;
+  bool stdOut = strcmp(outputFile, "-") == 0;
+  int fd = stdIn ? STDIN_FILENO : safeOpen(inputFile, O_RDONLY);
+  int fdOut = stdOut ? STDOUT_FILENO
+                     : safeOpen(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+  vector<char> buf(kBlock);
+  size_t have = 0;
+  uint64_t bytes_in = 0, bytes_out = 0;
+  bool eof = false;
+  while (!eof) {
+    if (have == buf.size())
+      buf.resize(2 * buf.size()); // a line longer than the block
+    size_t n = safeRead(fd, buf.data() + have, buf.size() - have, inputFile);
+    eof = n == 0;
+    have += n;
+    bytes_in += n;
+    // decode up to the last new line, or everything at the end
+    size_t lines = have;
+    if (!eof) {
+      while (lines > 0 && buf[lines - 1] != '\n')
+        lines--;
+      if (lines == 0)
+        continue;
+    }
+    size_t decoded = decodeBpe(buf.data(), lines);
+    safeWrite(fdOut, buf.data(), decoded, outputFile);
+    bytes_out += decoded;
+    memmove(buf.data(), buf.data() + lines, have - lines);
+    have -= lines;
+  }
+
+  fprintf(stderr, "Decoded %lu bytes into %lu bytes.\n", bytes_in, bytes_out);
+  if (!stdOut)
+    close(fdOut);
+  if (!stdIn)
+    close(fd);
+}
+
+// ============================================================================
+// ============================== Benchmarks ==================================
+// ============================================================================
+
+double secondsSince(const chrono::steady_clock::time_point &start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void printTiming(const char *name, double seconds, size_t ops) {
+  fprintf(stderr, "%-36s %8.3f s %10.1f ns/op\n", name, seconds,
+          1e9 * seconds / max<size_t>(ops, 1));
+}
+
+// counts words with a string keyed unordered_map, as a reference
+uint64_t countWordsBaseline(const char *f, size_t size,
+                            unordered_map<string, uint32_t> &counts) {
+  uint64_t total = 0;
+  size_t start = 0;
+  for (size_t i = 0; i <= size; i++) {
+    if (i == size || f[i] == ' ' || f[i] == '\n') {
+      if (i > start) {
+        counts[string(f + start, i - start)]++;
+        total++;
       }
+      start = i + 1;
     }
-    subwords = newSubwords;
   }
-  // check that we are only using words in the dictionary
-  if (vocab.size() > 0) {
-    vector<string> newSubwords;
-    limitVocab(subwords, newSubwords, reversed_codes, vocab);
-    subwords = newSubwords;
+  return total;
+}
+
+// alphabet, as a range of code points, and word lengths of a fake language
+struct SyntheticLanguage {
+  const char *name;
+  uint32_t first, size;
+  int min_length, max_length;
+};
+
+const SyntheticLanguage kSyntheticLanguages[] = {
+    {"latin", 'a', 26, 2, 12},      // 1 byte chars
+    {"cyrillic", 0x430, 32, 2, 12}, // 2 bytes chars
+    {"cjk", 0x4e00, 3000, 1, 4},    // 3 bytes chars
+};
+
+void appendUtf8(string &s, uint32_t c) {
+  if (c < 0x80) {
+    s.push_back(char(c));
+  } else if (c < 0x800) {
+    s.push_back(char(0xc0 | c >> 6));
+    s.push_back(char(0x80 | (c & 0x3f)));
+  } else {
+    s.push_back(char(0xe0 | c >> 12));
+    s.push_back(char(0x80 | (c >> 6 & 0x3f)));
+    s.push_back(char(0x80 | (c & 0x3f)));
+  }
+}
+
+/*
+    Text of `n` words drawn from a Zipf-like distribution over n / 8 random
+    words of `language`, to benchmark without a corpus.
+*/
+string syntheticText(size_t n, uint32_t seed,
+                     const SyntheticLanguage &language = kSyntheticLanguages[0]) {
+  mt19937 rng(seed);
+  size_t vocab_size = max<size_t>(n / 8, 1);
+  vector<string> vocab(vocab_size);
+  uniform_int_distribution<int> length(language.min_length,
+                                       language.max_length);
+  uniform_int_distribution<uint32_t> letter(
+      language.first, language.first + language.size - 1);
+  for (auto &word : vocab) {
+    int l = length(rng);
+    for (int i = 0; i < l; i++)
+      appendUtf8(word, letter(rng));
+  }
+  // rank r is drawn with a probability close to 1 / r
+  uniform_real_distribution<double> u(0, 1);
+  string text;
+  for (size_t i = 0; i < n; i++) {
+    size_t r = size_t(pow(double(vocab_size), u(rng))) - 1;
+    text += vocab[min(r, vocab_size - 1)];
+    text.push_back(i % 16 == 15 ? '\n' : ' ');
   }
-  // concat subWords
-  string result;
-  for (auto x : subwords) {
-    result = result + x + kTokenDelim + " ";
+  return text;
+}
+
+// contents of `input` if not null, else `n` synthetic words
+string benchText(const char *input, size_t n) {
+  if (input == nullptr)
+    return syntheticText(n, 42);
+  ifstream file(input);
+  if (!file) {
+    fprintf(stderr, "Cannot open text file %s\n", input);
+    exit(EXIT_FAILURE);
   }
-  return result.substr(
-      0,
-      result.size() - kEndWordLength - kTokenDelimLength - 1 // "</w>@@ "
-      );
+  return string(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
 }
 
-unordered_map<string, string> _buildbpes(
-    wMapCounts &word_count,
-    wMapCounts &vocab,
-    codesMap &codes,
-    reverseCodesMap &reversed_codes)
-{
-  // tokenize
-  unordered_map<string, vector<string>> bpeTok;
-  tokenize_str(word_count, bpeTok);
+/*
+    Microbenchmarks of the flat hash tables against the standard containers
+    they replace: word counting with string keys, and (left, right) pair
+    lookups as done by learnbpe. Words come from `input`, or are synthetic.
+*/
+void benchMaps(const char *input, size_t n) {
+  string text = benchText(input, n);
+  const char *f = text.data();
+  size_t size = text.size();
 
-  vector<pair<string, vector<string>>> bpeTokVec;
-  for (auto x : bpeTok)
+  // word counting
+  uint64_t words = 0, distinct = 0;
+  auto start = chrono::steady_clock::now();
   {
-    bpeTokVec.push_back(x);
+    unordered_map<string, uint32_t> counts;
+    words = countWordsBaseline(f, size, counts);
+    distinct = counts.size();
   }
-  // apply BPE codes to each word
-  unordered_map<string, string> bpe[kThreads];
-  vector<thread> threads;
-  for (size_t i = 0; i < kThreads; i++)
+  double std_count = secondsSince(start);
+  start = chrono::steady_clock::now();
   {
-    threads.emplace_back(
-        [&](size_t this_thread) {
-          for (size_t w = this_thread; w < bpeTokVec.size(); w += kThreads)
-          {
-            auto &x = bpeTokVec[w];
-            bpe[this_thread][x.first] =
-                process_bpe(x.second, codes, reversed_codes, vocab);
-          }
-        },
-        i);
+    FlatMap<StrView, uint32_t> counts;
+    vector<StrView> order;
+    countViews(f, 0, size, counts, order, false);
+  }
+  double flat_count = secondsSince(start);
+  fprintf(stderr, "%lu words, %lu distinct\n", words, distinct);
+  printTiming("count words: unordered_map<string>", std_count, words);
+  printTiming("count words: FlatMap<StrView>", flat_count, words);
+
+  // pairs of adjacent chars of the distinct words, as learnbpe first sees
+  vector<tp> pairs;
+  {
+    FlatMap<StrView, uint32_t> counts;
+    vector<StrView> order;
+    countViews(f, 0, size, counts, order, false);
+    for (auto &w : order) {
+      for (size_t i = 0; i + 1 < w.n; i++)
+        pairs.emplace_back((unsigned char)w.p[i], (unsigned char)w.p[i + 1]);
+      // and pairs of larger ids, as after many merges
+      for (size_t i = 0; i + 1 < w.n; i += 2)
+        pairs.emplace_back(hashBytes(w.p + i, 2) % 200000,
+                           hashBytes(w.p + i + 1, 2) % 200000);
+    }
+  }
+  uint64_t found = 0;
+  start = chrono::steady_clock::now();
+  {
+    unordered_map<tp, uint32_t, pair_hash> index;
+    for (auto &p : pairs)
+      index.emplace(p, uint32_t(index.size()));
+    for (auto &p : pairs)
+      found += index.find(p) != index.end();
+    for (auto &p : pairs)
+      index.erase(p);
   }
-  // build final BPE codes
-  unordered_map<string, string> final_bpe;
-  for (size_t i = 0; i < kThreads; i++)
+  double std_pairs = secondsSince(start);
+  start = chrono::steady_clock::now();
   {
-    threads[i].join();
-    for (auto x : bpe[i])
-    {
-      final_bpe[x.first] = x.second;
-    }
+    FlatMap<uint64_t, uint32_t> index;
+    for (auto &p : pairs)
+      index.insert(pairKey(p), uint32_t(index.size()));
+    for (auto &p : pairs)
+      found += index.find(pairKey(p)) != nullptr;
+    for (auto &p : pairs)
+      index.erase(pairKey(p));
   }
-  return final_bpe;
+  double flat_pairs = secondsSince(start);
+  fprintf(stderr, "%lu pair operations (%lu found)\n", 3 * pairs.size(),
+          found);
+  printTiming("pairs: unordered_map<tp, pair_hash>", std_pairs,
+              3 * pairs.size());
+  printTiming("pairs: FlatMap<uint64_t>", flat_pairs, 3 * pairs.size());
 }
 
-unordered_map<string, string> _applybpe_from_files(wMapCounts &word_count,
-                                                   const char *codesPath,
-                                                   const char *vocabPath) {
-  // read vocabulary (to which we want to limit the output file)
-  wMapCounts vocab;
-  if (vocabPath != "") {
-    readVocab(vocabPath, vocab);
+/*
+    Throughput of the text scanning kernels supported by the CPU on the
+    words of `input`, or on synthetic text.
+*/
+void benchScan(const char *input, size_t n) {
+  string text = benchText(input, n);
+  fprintf(stderr, "%lu bytes, %s kernels by default\n", text.size(),
+          scanKernels().name);
+  for (auto &k : supportedScanKernels()) {
+    uint64_t separators = 0, chars = 0;
+    auto start = chrono::steady_clock::now();
+    forEachMaskBit(k.separators, text.data(), text.size(),
+                   [&](size_t) { separators++; });
+    double separator_time = secondsSince(start);
+    start = chrono::steady_clock::now();
+    forEachMaskBit(k.charStarts, text.data(), text.size(),
+                   [&](size_t) { chars++; });
+    double char_time = secondsSince(start);
+    fprintf(stderr, "%s: %lu separators, %lu chars\n", k.name, separators,
+            chars);
+    printTiming("  separators (per byte)", separator_time, text.size());
+    printTiming("  char starts (per byte)", char_time, text.size());
   }
-  // read codes
-  codesMap codes;
-  reverseCodesMap reversed_codes;
-  readCodes(codesPath, codes, reversed_codes);
-  // apply BPE function
-  return _buildbpes(word_count, vocab, codes, reversed_codes);
 }
 
-unordered_map<string, string> _applybpe(
-  wMapCounts &word_count,
-  const tuple<codesMap, reverseCodesMap> &codes_tup,
-  wMapCounts &vocab)
-{
-  // read codes
-  codesMap codes = get<0>(codes_tup);
-  reverseCodesMap reversed_codes = get<1>(codes_tup);
-  // apply BPE function
-  return _buildbpes(word_count, vocab, codes, reversed_codes);
+// p-th percentile of `values`, which it sorts
+double percentile(vector<double> &values, double p) {
+  if (values.empty())
+    return 0;
+  sort(values.begin(), values.end());
+  return values[min(values.size() - 1, size_t(p * values.size()))];
 }
 
-void applybpe(const char *outputFile, const char *inputFile,
-              const char *codesPath, const char *vocabPath) {
-  // read input file words
-  wMapCounts word_count;
-  readText(inputFile, word_count);
-  // apply BPE
-  auto final_bpe = _applybpe_from_files(word_count, codesPath, vocabPath);
-  // output
-  outputText(outputFile, inputFile, final_bpe);
+/*
+    End to end throughput on synthetic corpora of several sizes and
+    languages: counting words, learning codes and applying them to the
+    whole text, and the latency of encoding single sentences (one line of
+    16 words) as the python apply_bpe does. Results are written as JSON to
+    `json`, "-" being stdout, and summed up on stderr.
+*/
+void benchSuite(const char *json, bool quick) {
+  vector<size_t> sizes = quick ? vector<size_t>{1 << 16}
+                               : vector<size_t>{1 << 16, 1 << 20};
+  const uint32_t kCodes = quick ? 200 : 1000;
+  const size_t kSentences = 2000;
+
+  FILE *out = string(json) == "-" ? stdout : fopen(json, "w");
+  if (out == nullptr) {
+    fprintf(stderr, "Cannot open output file %s\n", json);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(out, "{\n  \"threads\": %lu,\n  \"simd\": \"%s\",\n  \"results\": [",
+          ThreadPool::instance().size(), scanKernels().name);
+  const char *sep = "\n";
+  for (auto &language : kSyntheticLanguages) {
+    for (size_t n : sizes) {
+      string text = syntheticText(n, 42, language);
+      double mb = text.size() / 1e6;
+
+      auto start = chrono::steady_clock::now();
+      wMapCounts word_count;
+      uint64_t words = countWordsParallel(text.data(), text.size(), word_count);
+      double count_time = secondsSince(start);
+
+      start = chrono::steady_clock::now();
+      LearnState state;
+      initLearnState(word_count, state);
+      countPairs(state);
+      LearnOptions options;
+      vector<uint64_t> merge_ns;
+      options.merge_ns = &merge_ns;
+      tripletVec codes = learnCodes(kCodes, state, options);
+      double learn_time = secondsSince(start);
+      // latency of each merge, the first ones touching the most words
+      vector<double> merge_us;
+      for (uint64_t ns : merge_ns)
+        merge_us.push_back(ns / 1e3);
+      double merge_p50 = percentile(merge_us, 0.5);
+      double merge_p99 = percentile(merge_us, 0.99);
+      double merge_max = merge_us.empty() ? 0 : merge_us.back();
+      string merge_array;
+      for (size_t i = 0; i < merge_ns.size(); i++)
+        merge_array += (i > 0 ? ", " : "") + to_string(merge_ns[i]);
+
+      codesMap codes_map;
+      for (uint32_t i = 0; i < codes.size(); i++) {
+        codes_map[make_pair(get<0>(codes[i]), get<1>(codes[i]))] = i;
+      }
+      Encoder encoder(codes_map, wMapCounts());
+      start = chrono::steady_clock::now();
+      string encoded = encoder.encode(text);
+      double apply_time = secondsSince(start);
+
+      // one sentence per line of the text
+      vector<double> latencies;
+      size_t begin = 0;
+      while (latencies.size() < kSentences && begin < text.size()) {
+        size_t end = text.find('\n', begin);
+        end = end == string::npos ? text.size() : end;
+        string sentence = text.substr(begin, end - begin);
+        start = chrono::steady_clock::now();
+        encoder.encode(sentence);
+        latencies.push_back(1e6 * secondsSince(start));
+        begin = end + 1;
+      }
+      double p50 = percentile(latencies, 0.5);
+      double p99 = percentile(latencies, 0.99);
+
+      fprintf(stderr,
+              "%-8s %8lu words %7.1f MB: count %6.1f MB/s, learn %7.1f us/merge "
+              "(p50 %.1f us p99 %.1f us), apply %6.1f MB/s, sentence p50 %.1f "
+              "us p99 %.1f us\n",
+              language.name, words, mb, mb / count_time,
+              1e6 * learn_time / max<size_t>(codes.size(), 1), merge_p50,
+              merge_p99, mb / apply_time, p50, p99);
+      fprintf(out,
+              "%s    {\"language\": \"%s\", \"words\": %lu, \"unique_words\": "
+              "%lu, \"bytes\": %lu,\n"
+              "     \"count\": {\"seconds\": %.6f, \"words_per_s\": %.0f, "
+              "\"mb_per_s\": %.2f},\n"
+              "     \"learn\": {\"codes\": %lu, \"seconds\": %.6f, "
+              "\"us_per_merge\": %.2f,\n"
+              "               \"merge_us\": {\"p50\": %.2f, \"p99\": %.2f, "
+              "\"max\": %.2f},\n"
+              "               \"merge_ns\": [%s]},\n"
+              "     \"apply\": {\"seconds\": %.6f, \"words_per_s\": %.0f, "
+              "\"mb_per_s\": %.2f},\n"
+              "     \"sentence_latency_us\": {\"sentences\": %lu, \"p50\": "
+              "%.2f, \"p99\": %.2f}}",
+              sep, language.name, words, word_count.size(), text.size(),
+              count_time, words / count_time, mb / count_time, codes.size(),
+              learn_time, 1e6 * learn_time / max<size_t>(codes.size(), 1),
+              merge_p50, merge_p99, merge_max, merge_array.c_str(), apply_time, words / apply_time, mb / apply_time,
+              latencies.size(), p50, p99);
+      sep = ",\n";
+    }
+  }
+  fprintf(out, "\n  ]\n}\n");
+  if (out != stdout)
+    fclose(out);
+}
+
+void bench(int argc, char **argv) {
+  string what = argc > 2 ? argv[2] : "";
+  if (what == "suite") {
+    const char *json = "-";
+    bool quick = false;
+    for (int i = 3; i < argc; i++) {
+      if (string(argv[i]) == "--json" && i + 1 < argc)
+        json = argv[++i];
+      else if (string(argv[i]) == "--quick")
+        quick = true;
+    }
+    benchSuite(json, quick);
+    return;
+  }
+  const char *input = nullptr;
+  size_t n = 1 << 22;
+  if (argc > 3) {
+    // a number of synthetic words, or an input file
+    char *end;
+    size_t v = strtoul(argv[3], &end, 10);
+    if (*end == 0)
+      n = v;
+    else
+      input = argv[3];
+  }
+  if (what == "maps") {
+    benchMaps(input, n);
+  } else if (what == "scan") {
+    benchScan(input, n);
+  } else {
+    fprintf(stderr, "usage: fast bench (maps | scan) [nWords | input]\n"
+                    "       fast bench suite [--json output] [--quick]\n");
+    exit(EXIT_FAILURE);
+  }
 }
 
+#ifndef FASTBPE_NO_PYTHON
 // ============================================================================
 // ======================= pyBPE functions ====================================
 // ============================================================================
@@ -837,6 +4262,168 @@ convert_pycodes_to_mapcodes(py::dict &py_codes)
 }
 
 
+/*
+    Releases the GIL for as long as it lives, so that other python threads
+    run while the C++ code works. No python object may be touched meanwhile.
+*/
+class ScopedGILRelease {
+public:
+  ScopedGILRelease() : state(PyEval_SaveThread()) {}
+  ~ScopedGILRelease() { PyEval_RestoreThread(state); }
+
+private:
+  PyThreadState *state;
+};
+
+vector<string> convert_pylist_to_vector(const py::list &py_list)
+{
+  vector<string> strings;
+  for (int i = 0; i < len(py_list); ++i)
+  {
+    strings.push_back(py::extract<string>(py_list[i]));
+  }
+  return strings;
+}
+
+py::list convert_vector_to_pylist(const vector<string> &strings)
+{
+  py::list py_list;
+  for (auto &x : strings)
+  {
+    py_list.append(x);
+  }
+  return py_list;
+}
+
+/*
+    Minimal python object exporting the contents of a C++ vector through the
+    buffer protocol, so that it can be wrapped by a memoryview (or a numpy
+    array) without copying. The object owns the vector.
+*/
+struct PyArrayBuffer {
+  PyObject_HEAD
+  void *data;
+  Py_ssize_t length;
+  Py_ssize_t itemsize;
+  const char *format;
+  void (*free_owner)(void *);
+  void *owner;
+};
+
+int array_buffer_getbuffer(PyObject *obj, Py_buffer *view, int flags)
+{
+  PyArrayBuffer *self = (PyArrayBuffer *)obj;
+  int ret = PyBuffer_FillInfo(view, obj, self->data,
+                              self->length * self->itemsize, 1, flags);
+  if (ret == 0)
+  {
+    view->itemsize = self->itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? (char *)self->format : nullptr;
+    // shape points into the object, which outlives the view
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? &self->length : nullptr;
+    view->strides = (flags & PyBUF_STRIDES) ? &self->itemsize : nullptr;
+  }
+  return ret;
+}
+
+void array_buffer_dealloc(PyObject *obj)
+{
+  PyArrayBuffer *self = (PyArrayBuffer *)obj;
+  self->free_owner(self->owner);
+  Py_TYPE(obj)->tp_free(obj);
+}
+
+PyBufferProcs array_buffer_procs = {array_buffer_getbuffer, nullptr};
+
+PyTypeObject array_buffer_type = {PyVarObject_HEAD_INIT(nullptr, 0)};
+
+void init_array_buffer_type()
+{
+  array_buffer_type.tp_name = "libpybpe.ArrayBuffer";
+  array_buffer_type.tp_basicsize = sizeof(PyArrayBuffer);
+  array_buffer_type.tp_flags = Py_TPFLAGS_DEFAULT;
+  array_buffer_type.tp_doc = "Read-only buffer over encoder results";
+  array_buffer_type.tp_dealloc = array_buffer_dealloc;
+  array_buffer_type.tp_as_buffer = &array_buffer_procs;
+  if (PyType_Ready(&array_buffer_type) < 0)
+    py::throw_error_already_set();
+}
+
+template <typename T> const char *buffer_format();
+template <> const char *buffer_format<int32_t>() { return "i"; }
+template <> const char *buffer_format<int64_t>() { return "q"; }
+
+// moves `values` into a python memoryview, without copying its contents
+template <typename T> py::object to_memoryview(vector<T> &&values)
+{
+  PyArrayBuffer *buffer = PyObject_New(PyArrayBuffer, &array_buffer_type);
+  if (buffer == nullptr)
+    py::throw_error_already_set();
+  auto *owner = new vector<T>(move(values));
+  buffer->data = owner->data();
+  buffer->length = owner->size();
+  buffer->itemsize = sizeof(T);
+  buffer->format = buffer_format<T>();
+  buffer->owner = owner;
+  buffer->free_owner = [](void *p) { delete (vector<T> *)p; };
+  py::object exporter{py::handle<>((PyObject *)buffer)};
+  return py::object(py::handle<>(PyMemoryView_FromObject(exporter.ptr())));
+}
+
+/*
+    Integers given from python, read in place when `obj` exports a buffer
+    of native T (the memoryviews returned by encode_ids, numpy arrays,
+    array.array) and copied from any other sequence of ints otherwise.
+*/
+template <typename T> class IntArgument {
+public:
+  explicit IntArgument(const py::object &obj) {
+    if (PyObject_CheckBuffer(obj.ptr()) &&
+        PyObject_GetBuffer(obj.ptr(), &view,
+                           PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) == 0) {
+      if (view.itemsize == sizeof(T) && isNativeInt(view.format)) {
+        has_view = true;
+        values_ = (const T *)view.buf;
+        size_ = view.len / sizeof(T);
+        return;
+      }
+      PyBuffer_Release(&view);
+    }
+    PyErr_Clear();
+    for (int i = 0; i < len(obj); ++i)
+    {
+      copy.push_back(py::extract<T>(obj[i]));
+    }
+    values_ = copy.data();
+    size_ = copy.size();
+  }
+  ~IntArgument() {
+    if (has_view)
+      PyBuffer_Release(&view);
+  }
+  IntArgument(const IntArgument &) = delete;
+  IntArgument &operator=(const IntArgument &) = delete;
+
+  const T *values() const { return values_; }
+  size_t size() const { return size_; }
+
+private:
+  static bool isNativeInt(const char *format) {
+    if (format == nullptr)
+      return false;
+    if (*format == '@' || *format == '=')
+      format++;
+    return strlen(format) == 1 && strchr("hilqn", *format) != nullptr;
+  }
+
+  Py_buffer view;
+  bool has_view = false;
+  vector<T> copy;
+  const T *values_;
+  size_t size_;
+};
+
 // ===================== exposed functions ========================
 
 py::dict read_vocab_file(const string vocabPath)
@@ -845,6 +4432,7 @@ py::dict read_vocab_file(const string vocabPath)
   wMapCounts vocab;
   if (vocabPath != "")
   {
+    ScopedGILRelease nogil;
     readVocab(vocabFile, vocab);
   }
   py::dict vocabDict;
@@ -862,6 +4450,7 @@ py::list read_codes_file(const string codesPath)
   reverseCodesMap reversed_codes;
   if (codesPath != "")
   {
+    ScopedGILRelease nogil;
     readCodes(codesFile, codes, reversed_codes);
   }
   py::dict codes_dict;
@@ -888,7 +4477,11 @@ py::list read_codes_file(const string codesPath)
 py::dict get_vocabs(const string &text)
 {
   string text_ = text; // make a copy that can be modified
-  wMapCounts word_count = getvocabs(text_);
+  wMapCounts word_count;
+  {
+    ScopedGILRelease nogil;
+    word_count = getvocabs(text_);
+  }
   py::dict map;
   for (auto x : word_count)
   {
@@ -900,7 +4493,56 @@ py::dict get_vocabs(const string &text)
 py::list learn_bpes(const uint32_t kNPairs, const string &text)
 {
   string text_ = text; // make a copy that can be modified
-  tripletVec codes = learnbpes(kNPairs, text_);
+  tripletVec codes;
+  {
+    ScopedGILRelease nogil;
+    codes = learnbpes(kNPairs, text_);
+  }
+  py::list pycodes;
+  for (tripletVec::const_iterator i = codes.begin(); i != codes.end(); ++i)
+  {
+    pycodes.append(py::make_tuple(get<0>(*i), get<1>(*i), get<2>(*i)));
+  }
+  return pycodes;
+}
+
+vector<const char *> convert_pylist_to_paths(const vector<string> &paths)
+{
+  vector<const char *> c_paths;
+  for (auto &path : paths)
+  {
+    c_paths.push_back(path.c_str());
+  }
+  return c_paths;
+}
+
+// word counts of text files, as `getvocab` counts them
+py::dict get_vocab_files(const py::list &paths)
+{
+  vector<string> paths_ = convert_pylist_to_vector(paths);
+  wMapCounts word_count;
+  {
+    ScopedGILRelease nogil;
+    for (auto fp : convert_pylist_to_paths(paths_))
+      readText(fp, word_count);
+  }
+  py::dict map;
+  for (auto x : word_count)
+  {
+    map[x.first] = x.second;
+  }
+  return map;
+}
+
+// codes learned from text files or vocabulary shards, as `learnbpe` does
+py::list learn_bpe_files(const uint32_t kNPairs, const py::list &paths)
+{
+  vector<string> paths_ = convert_pylist_to_vector(paths);
+  tripletVec codes;
+  {
+    ScopedGILRelease nogil;
+    codes = learnbpe(kNPairs, convert_pylist_to_paths(paths_), LearnOptions());
+  }
   py::list pycodes;
   for (tripletVec::const_iterator i = codes.begin(); i != codes.end(); ++i)
   {
@@ -913,41 +4555,284 @@ string apply_bpe(const string &text,
                  py::dict &py_codes,
                  py::dict &py_vocab)
 {
-  // pad the input string
-  string text_ = text; // make a copy that can be modified
-  padText(text_);
-  // read input text words
-  wMapCounts word_count;
-  readString(text_, word_count);
-
   // trasnform pyObjects into C++ data structures
   tuple<codesMap, reverseCodesMap> codes =
     convert_pycodes_to_mapcodes(py_codes);
   wMapCounts vocab = convert_pyvocab_to_mapwc(py_vocab);
 
-  // apply BPE
-  auto final_bpe = _applybpe(word_count, codes, vocab);
-  // output
-  return outputString(text_, final_bpe);
+  ScopedGILRelease nogil;
+  Encoder encoder(get<0>(codes), vocab, 0);
+  return encoder.encode(text);
 }
 
 string apply_bpe_from_files(const string &text,
                             const string codesPath,
                             const string vocabPath)
 {
-  // pad the input string
-  string text_ = text; // make a copy that can be modified
-  padText(text_);
-  // read input text words
-  wMapCounts word_count;
-  readString(text_, word_count);
-  // convert strings
-  const char * codes = codesPath.c_str();
-  const char * vocab = vocabPath.c_str();
+  ScopedGILRelease nogil;
+  Encoder encoder(codesPath, vocabPath, 0);
+  return encoder.encode(text);
+}
 
-  // apply BPE
-  auto final_bpe = _applybpe_from_files(word_count, codes, vocab);
-  return outputString(text_, final_bpe);
+// text with the BPE joined back, no model needed
+string decode_bpe(const string &text)
+{
+  ScopedGILRelease nogil;
+  return decode(text);
+}
+
+py::list decode_bpe_batch(const py::list &texts)
+{
+  vector<string> texts_ = convert_pylist_to_vector(texts);
+  vector<string> results;
+  {
+    ScopedGILRelease nogil;
+    results = decodeBatch(texts_);
+  }
+  return convert_vector_to_pylist(results);
+}
+
+// `applybpe`: streamed unless the input is a regular file
+void apply_bpe_file(const string &outputPath, const string &inputPath,
+                    const string &codesPath, const string &vocabPath)
+{
+  ScopedGILRelease nogil;
+  applybpe(outputPath.c_str(), inputPath.c_str(), codesPath.c_str(),
+           vocabPath.c_str());
+}
+
+void compile_model(const string &codesPath, const string &vocabPath,
+                   const string &outputPath)
+{
+  ScopedGILRelease nogil;
+  compile(outputPath.c_str(), codesPath.c_str(), vocabPath.c_str());
+}
+
+int compile_model_fd(const string &codesPath, const string &vocabPath)
+{
+  ScopedGILRelease nogil;
+  return compileToMemfd(codesPath.c_str(), vocabPath.c_str());
+}
+
+void set_num_threads(size_t n)
+{
+  // waits for the loops running on other threads
+  ScopedGILRelease nogil;
+  ThreadPool::instance().setSize(n);
+}
+
+size_t get_num_threads()
+{
+  return ThreadPool::instance().size();
+}
+
+// name of the text scanning kernel in use, e.g. as forced by $PYBPE_SIMD
+string scan_kernel()
+{
+  return scanKernels().name;
+}
+
+void set_inline_threshold(size_t n)
+{
+  ThreadPool::instance().setInlineThreshold(n);
+}
+
+size_t get_inline_threshold()
+{
+  return ThreadPool::instance().inlineThreshold();
+}
+
+void set_stats_enabled(bool enabled)
+{
+  Stats::instance().setEnabled(enabled);
+}
+
+void reset_stats()
+{
+  Stats::instance().reset();
+}
+
+// counters, and the time and pair table size of every learnbpe merge
+py::dict get_stats()
+{
+  auto &stats = Stats::instance();
+  py::dict dict;
+  dict["enabled"] = statsOn();
+  for (int c = 0; c < Stats::kNumCounters; c++) {
+    dict[Stats::name(Stats::Counter(c))] = stats.get(Stats::Counter(c));
+  }
+  vector<uint64_t> merge_ns, pairs;
+  stats.learnIterations(merge_ns, pairs);
+  py::list py_merge_ns, py_pairs;
+  for (size_t i = 0; i < merge_ns.size(); i++) {
+    py_merge_ns.append(merge_ns[i]);
+    py_pairs.append(pairs[i]);
+  }
+  dict["learn_merge_ns"] = py_merge_ns;
+  dict["learn_pairs"] = py_pairs;
+  return dict;
+}
+
+// ===================== Encoder methods ========================
+
+boost::shared_ptr<Encoder> make_encoder(const string &codesPath,
+                                        const string &vocabPath,
+                                        size_t cacheSize)
+{
+  ScopedGILRelease nogil;
+  return boost::shared_ptr<Encoder>(
+      new Encoder(codesPath, vocabPath, cacheSize));
+}
+
+// compiled model mapped from a descriptor, e.g. from compile_model_fd
+boost::shared_ptr<Encoder> open_model_fd(int fd, size_t cacheSize)
+{
+  ScopedGILRelease nogil;
+  return boost::shared_ptr<Encoder>(new Encoder(fd, cacheSize));
+}
+
+string encoder_encode(const Encoder &encoder, const string &text)
+{
+  ScopedGILRelease nogil;
+  return encoder.encode(text);
+}
+
+py::list encoder_encode_batch(const Encoder &encoder, const py::list &texts)
+{
+  vector<string> texts_ = convert_pylist_to_vector(texts);
+  vector<string> results;
+  {
+    ScopedGILRelease nogil;
+    results = encoder.encodeBatch(texts_);
+  }
+  return convert_vector_to_pylist(results);
+}
+
+py::tuple encoder_encode_ids(const Encoder &encoder, const py::list &texts)
+{
+  vector<string> texts_ = convert_pylist_to_vector(texts);
+  vector<int32_t> ids;
+  vector<int64_t> offsets;
+  {
+    ScopedGILRelease nogil;
+    encoder.encodeIds(texts_, ids, offsets);
+  }
+  return py::make_tuple(to_memoryview(move(ids)), to_memoryview(move(offsets)));
+}
+
+/*
+    Texts of the token id sequences ids[offsets[i]:offsets[i + 1]], as
+    returned by encode_ids. Raises IndexError on ids outside the token
+    table (but the unk id) or offsets outside `ids`.
+*/
+py::list encoder_decode_ids(const Encoder &encoder, const py::object &ids,
+                            const py::object &offsets)
+{
+  IntArgument<int32_t> ids_(ids);
+  IntArgument<int64_t> offsets_(offsets);
+  const int64_t num_outputs = encoder.getModel().header().num_outputs;
+  const int32_t unk = encoder.unkId();
+  for (size_t i = 0; i < ids_.size(); ++i)
+  {
+    int32_t id = ids_.values()[i];
+    if (id != unk && (id < 0 || id >= num_outputs))
+      throw out_of_range("token id " + to_string(id) +
+                         " is not in the token table");
+  }
+  for (size_t i = 0; i < offsets_.size(); ++i)
+  {
+    int64_t offset = offsets_.values()[i];
+    if (offset < 0 || offset > int64_t(ids_.size()) ||
+        (i > 0 && offset < offsets_.values()[i - 1]))
+      throw out_of_range("offsets must increase within the ids");
+  }
+  vector<string> results;
+  {
+    ScopedGILRelease nogil;
+    if (offsets_.size() > 1)
+      results = encoder.decodeIdsBatch(ids_.values(), offsets_.values(),
+                                       offsets_.size() - 1);
+  }
+  return convert_vector_to_pylist(results);
+}
+
+/*
+    Token ids of the texts along with the byte span of each token in its
+    text, as four zero-copy memoryviews: ids, starts, ends and offsets.
+*/
+py::tuple encoder_encode_offsets(const Encoder &encoder, const py::list &texts)
+{
+  vector<string> texts_ = convert_pylist_to_vector(texts);
+  vector<int32_t> ids;
+  vector<int64_t> offsets, starts, ends;
+  {
+    ScopedGILRelease nogil;
+    encoder.encodeIds(texts_, ids, offsets, &starts, &ends);
+  }
+  return py::make_tuple(to_memoryview(move(ids)), to_memoryview(move(starts)),
+                        to_memoryview(move(ends)), to_memoryview(move(offsets)));
+}
+
+/*
+    (token, start, end) of every token of the BPE of `text`, the token
+    spanning the bytes [start, end) of its UTF-8 encoding. Tokens come out
+    of the same encoding as their spans.
+*/
+py::list encoder_encode_spans(const Encoder &encoder, const string &text)
+{
+  vector<int32_t> ids;
+  vector<int64_t> offsets, starts, ends;
+  vector<string> tokens;
+  {
+    ScopedGILRelease nogil;
+    encoder.encodeIds(vector<string>(1, text), ids, offsets, &starts, &ends,
+                      &tokens);
+  }
+  py::list spans;
+  for (size_t i = 0; i < tokens.size(); ++i)
+    spans.append(py::make_tuple(tokens[i], starts[i], ends[i]));
+  return spans;
+}
+
+void encoder_set_unk_id(Encoder &encoder, int32_t id)
+{
+  if (id < 0)
+    throw invalid_argument("the unk id must not be negative");
+  encoder.setUnkId(id);
+}
+
+py::list encoder_token_table(const Encoder &encoder)
+{
+  return convert_vector_to_pylist(encoder.tokenTable());
+}
+
+size_t encoder_warmup(const Encoder &encoder, size_t n)
+{
+  ScopedGILRelease nogil;
+  return encoder.warmup(n);
+}
+
+py::dict encoder_cache_stats(const Encoder &encoder)
+{
+  BpeCache &cache = encoder.getCache();
+  py::dict stats;
+  stats["hits"] = cache.hits.load();
+  stats["misses"] = cache.misses.load();
+  stats["evictions"] = cache.evictions.load();
+  stats["size"] = cache.size();
+  stats["capacity"] = cache.capacity();
+  return stats;
+}
+
+void encoder_set_cache_size(const Encoder &encoder, size_t size)
+{
+  ScopedGILRelease nogil;
+  encoder.getCache().setCapacity(size);
+}
+
+void encoder_clear_cache(const Encoder &encoder)
+{
+  encoder.getCache().clear();
 }
 
 
@@ -1012,6 +4897,8 @@ BOOST_PYTHON_MODULE(libpybpe)
 
     // register the from-python converter
     PythonToPairConverter<string, string>();
+    // type of the buffers returned by Encoder.encode_ids
+    init_array_buffer_type();
 
     // Expose the functions.
     // def("pass_vocab_and_codes", pass_vocab_and_codes);
@@ -1019,17 +4906,74 @@ BOOST_PYTHON_MODULE(libpybpe)
     def("read_codes_file", read_codes_file);
     def("get_vocabs", get_vocabs);
     def("learn_bpes", learn_bpes);
+    def("get_vocab_files", get_vocab_files);
+    def("learn_bpe_files", learn_bpe_files);
     def("apply_bpe", apply_bpe);
     def("apply_bpe_from_files", apply_bpe_from_files);
+    def("apply_bpe_file", apply_bpe_file);
+    def("decode", decode_bpe);
+    def("decode_batch", decode_bpe_batch);
+    def("compile_model", compile_model);
+    def("compile_model_fd", compile_model_fd);
+    def("set_num_threads", set_num_threads);
+    def("get_num_threads", get_num_threads);
+    def("scan_kernel", scan_kernel);
+    def("set_inline_threshold", set_inline_threshold);
+    def("get_inline_threshold", get_inline_threshold);
+    def("set_stats_enabled", set_stats_enabled);
+    def("reset_stats", reset_stats);
+    def("get_stats", get_stats);
+
+    // Codes and vocab loaded once and reused across `encode` calls
+    class_<Encoder, boost::shared_ptr<Encoder>, boost::noncopyable>(
+        "Encoder", no_init)
+        .def("__init__",
+             make_constructor(&make_encoder, default_call_policies(),
+                              (py::arg("codes_path"), py::arg("vocab_path") = "",
+                               py::arg("cache_size") = kDefaultCacheSize)))
+        .def("encode", encoder_encode)
+        .def("encode_batch", encoder_encode_batch)
+        .def("encode_ids", encoder_encode_ids)
+        .def("encode_offsets", encoder_encode_offsets)
+        .def("encode_spans", encoder_encode_spans)
+        .def("decode_ids", encoder_decode_ids)
+        .def("token_table", encoder_token_table)
+        .def("token_id", &Encoder::tokenId)
+        .def("unk_id", &Encoder::unkId)
+        .def("set_unk_id", encoder_set_unk_id)
+        .def("warmup", encoder_warmup)
+        .def("cache_stats", encoder_cache_stats)
+        .def("set_cache_size", encoder_set_cache_size)
+        .def("clear_cache", encoder_clear_cache)
+        .def("num_codes", &Encoder::numCodes)
+        .def("vocab_size", &Encoder::vocabSize);
+    def("open_model_fd", open_model_fd,
+        (py::arg("fd"), py::arg("cache_size") = kDefaultCacheSize));
 }
 
 
 
+#endif // FASTBPE_NO_PYTHON
+
 // ============================================================================
 // ============================= MAIN entry point =============================
 // ============================================================================
 
 int main(int argc, char **argv) {
+  // --stats[=file] may come anywhere, stats are dumped as JSON at the end
+  const char *stats_file = nullptr;
+  int kept = 1;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--stats", 7) == 0 &&
+        (argv[i][7] == 0 || argv[i][7] == '=')) {
+      stats_file = argv[i][7] == '=' ? argv[i] + 8 : "-";
+      Stats::instance().setEnabled(true);
+    } else {
+      argv[kept++] = argv[i];
+    }
+  }
+  argc = kept;
+
   if (argc < 2) {
     printUsage();
     exit(EXIT_FAILURE);
@@ -1045,9 +4989,21 @@ int main(int argc, char **argv) {
     print_word_map_count(c);
   }
   else if (command == "getvocab") {
-    // get vocab from 1 or two files
-    assert(argc == 3 || argc == 4);
-    getvocab(argv[2], argc == 4 ? argv[3] : "");
+    // get vocab from any number of files
+    const char *shard = nullptr;
+    vector<const char *> inputs;
+    for (int i = 2; i < argc; i++) {
+      if (string(argv[i]) == "--shard" && i + 1 < argc)
+        shard = argv[++i];
+      else
+        inputs.push_back(argv[i]);
+    }
+    assert(!inputs.empty());
+    getvocab(inputs, shard);
+  }
+  else if (command == "mergevocab") {
+    assert(argc >= 4);
+    mergevocab(argv[2], vector<const char *>(argv + 3, argv + argc));
   }
   else if (command == "learnbpes") {
     // learn BPE code from string
@@ -1059,8 +5015,27 @@ int main(int argc, char **argv) {
         cout << get<0>(*i) << " " << get<1>(*i) << " " << get<2>(*i) << endl;
   }
   else if (command == "learnbpe") {
-    assert(argc == 4 || argc == 5);
-    learnbpe(stoi(argv[2]), argv[3], argc == 5 ? argv[4] : "");
+    // options may come anywhere after the number of codes
+    LearnOptions options;
+    options.print = true;
+    vector<const char *> inputs;
+    for (int i = 3; i < argc; i++) {
+      string arg = argv[i];
+      bool has_value = i + 1 < argc;
+      if (arg == "--checkpoint" && has_value) {
+        options.checkpoint = argv[++i];
+      } else if (arg == "--checkpoint-every" && has_value) {
+        options.checkpoint_every = max(1, stoi(argv[++i]));
+      } else if (arg == "--resume" && has_value) {
+        options.resume = argv[++i];
+      } else if (arg == "--init-codes" && has_value) {
+        options.init_codes = argv[++i];
+      } else {
+        inputs.push_back(argv[i]);
+      }
+    }
+    assert(options.resume != nullptr ? inputs.empty() : !inputs.empty());
+    learnbpe(stoi(argv[2]), inputs, options);
   }
   // else if (command == "applybpes") {
   //   assert(argc == 5);
@@ -1072,9 +5047,22 @@ int main(int argc, char **argv) {
     assert(argc == 5 || argc == 6);
     applybpe(argv[2], argv[3], argv[4], argc == 6 ? argv[5] : "");
   }
+  else if (command == "unbpe") {
+    assert(argc == 4);
+    unbpe(argv[2], argv[3]);
+  }
+  else if (command == "bench") {
+    bench(argc, argv);
+  }
+  else if (command == "compile") {
+    assert(argc == 4 || argc == 5);
+    compile(argv[2], argv[3], argc == 5 ? argv[4] : "");
+  }
   else {
     printUsage();
     exit(EXIT_FAILURE);
   }
+  if (stats_file != nullptr)
+    dumpStats(stats_file);
   return 0;
 }
@@ -2,8 +2,11 @@ import os
 import sys
 import typing
 import logging
+import threading
 import coloredlogs
 
+from collections import OrderedDict
+
 from typing import Text, List, Tuple, Dict
 
 sys.path.append(os.path.dirname(os.path.abspath(__file__)))
@@ -16,11 +19,20 @@ coloredlogs.install(level='INFO',
                     fmt='%(asctime)s %(levelname)-8s %(name)s  - %(message)s')
 
 
+# encoders kept for the one-shot calls, most recently used last
+ONE_SHOT_ENCODERS = 8
+
+
 class pyBPE:
 
-    def __init__(self, vocab_path=None, codes_path=None):
+    _one_shot_encoders = OrderedDict()
+    _one_shot_lock = threading.Lock()
+
+    def __init__(self, vocab_path=None, codes_path=None, cache_size=65536):
         self.vocab_path = vocab_path
         self.codes_path = codes_path
+        self.cache_size = cache_size
+        self.encoder = None
 
     def read_vocab_file(self) -> Dict:
         if self.vocab_path is None:
@@ -33,32 +45,204 @@ class pyBPE:
         codes, reverse_codes = bpe.read_codes_file(self.codes_path)
         return codes, reverse_codes
 
-    def load(self):
+    def load(self, warmup: int = 0):
+        if self.codes_path is None:
+            raise ValueError("Codes need to first be loaded")
         try:
-            self.vocab = self.read_vocab_file()
-            self.codes, _ = self.read_bpe_file()
+            # codes and vocab are kept in their C++ form and reused
+            self.encoder = bpe.Encoder(self.codes_path, self.vocab_path or "",
+                                       self.cache_size)
+            # pre-compute the BPE of the most frequent vocab words
+            if warmup > 0:
+                self.encoder.warmup(warmup)
         except Exception as e:
             logger.error("Error loading BPE codes and vocab!")
             logger.exception(e)
 
+    def cache_stats(self) -> Dict[Text, int]:
+        if self.encoder is None:
+            raise ValueError("Vocab and Codes not loaded. Call load()")
+        return self.encoder.cache_stats()
+
     def apply_bpe(self, text: Text) -> Text:
-        if self.vocab is None or self.codes is None:
+        if self.encoder is None:
             raise ValueError("Vocab and Codes not loaded. Call load()")
         try:
-            return bpe.apply_bpe(text, self.codes, self.vocab)
+            return self.encoder.encode(text)
         except Exception as e:
             logger.error("Unknown error "
                          "while applying BPE codes: {}".format(e))
             logger.exception(e)
 
+    def apply_bpe_batch(self, texts: List[Text]) -> List[Text]:
+        if self.encoder is None:
+            raise ValueError("Vocab and Codes not loaded. Call load()")
+        try:
+            # one call for the whole batch, words are segmented once
+            return self.encoder.encode_batch(texts)
+        except Exception as e:
+            logger.error("Unknown error "
+                         "while applying BPE codes: {}".format(e))
+            logger.exception(e)
+
+    def apply_bpe_ids(self, texts: List[Text]) -> Tuple[memoryview, memoryview]:
+        """Token ids of the BPE encoded texts, as an int32 buffer, and the
+        int64 offsets of each text in it: ids of texts[i] are
+        ids[offsets[i]:offsets[i + 1]]. Both buffers are zero-copy views
+        over the C++ results (e.g. usable with numpy.frombuffer)."""
+        if self.encoder is None:
+            raise ValueError("Vocab and Codes not loaded. Call load()")
+        return self.encoder.encode_ids(texts)
+
+    def apply_bpe_offsets(self, texts: List[Text]) -> Tuple[memoryview, ...]:
+        """As `apply_bpe_ids`, with the byte span of every token in the UTF-8
+        text it comes from: (ids, starts, ends, offsets), token ids[j] of
+        texts[i] spanning texts[i].encode()[starts[j]:ends[j]]. Starts and
+        ends are int64 zero-copy views, as the offsets."""
+        if self.encoder is None:
+            raise ValueError("Vocab and Codes not loaded. Call load()")
+        return self.encoder.encode_offsets(texts)
+
+    def apply_bpe_spans(self, text: Text) -> List[Tuple[Text, int, int]]:
+        # (token, start, end) of every token of the BPE of `text`, in a
+        # single encoding
+        if self.encoder is None:
+            raise ValueError("Vocab and Codes not loaded. Call load()")
+        return self.encoder.encode_spans(text)
+
+    def decode_ids(self, ids, offsets=None) -> List[Text]:
+        """Texts of token id sequences, given as returned by `apply_bpe_ids`
+        (any int buffer or sequence will do). Without offsets, `ids` is a
+        single sequence and its text is returned."""
+        if self.encoder is None:
+            raise ValueError("Vocab and Codes not loaded. Call load()")
+        if offsets is None:
+            return self.encoder.decode_ids(ids, [0, len(ids)])[0]
+        return self.encoder.decode_ids(ids, offsets)
+
+    @staticmethod
+    def decode(text: Text) -> Text:
+        # joins the "@@ " separated subwords back, no codes needed
+        return bpe.decode(text)
+
+    @staticmethod
+    def decode_batch(texts: List[Text]) -> List[Text]:
+        return bpe.decode_batch(texts)
+
+    def unk_id(self) -> int:
+        """Id of the tokens missing from the token table: its size unless
+        set with `set_unk_id`. Ids are never negative."""
+        if self.encoder is None:
+            raise ValueError("Vocab and Codes not loaded. Call load()")
+        return self.encoder.unk_id()
+
+    def set_unk_id(self, unk_id: int) -> None:
+        # e.g. the id of an "<unk>" vocabulary entry
+        if self.encoder is None:
+            raise ValueError("Vocab and Codes not loaded. Call load()")
+        self.encoder.set_unk_id(unk_id)
+
+    def token_table(self) -> List[Text]:
+        if self.encoder is None:
+            raise ValueError("Vocab and Codes not loaded. Call load()")
+        return self.encoder.token_table()
+
     def apply_bpe_from_files(text, codes_file, vocab_file):
         try:
-            return bpe.apply_bpe_from_files(text, codes_file, vocab_file)
+            return pyBPE._one_shot_encoder(codes_file, vocab_file).encode(text)
         except Exception as e:
             logger.error("Unknown error "
                          "while applying BPE codes: {}".format(e))
             logger.exception(e)
 
+    @staticmethod
+    def _one_shot_encoder(codes_path: Text, vocab_path: Text) -> bpe.Encoder:
+        """Encoder of the codes and vocab files, loaded once for as long as
+        the files are not modified, as `load()` does for an instance."""
+        paths = [path for path in (codes_path, vocab_path) if path]
+        key = (codes_path, vocab_path or "") + tuple(
+            (st.st_mtime_ns, st.st_size) for st in map(os.stat, paths))
+        with pyBPE._one_shot_lock:
+            encoder = pyBPE._one_shot_encoders.pop(key, None)
+        if encoder is None:
+            encoder = bpe.Encoder(codes_path, vocab_path or "", 65536)
+        with pyBPE._one_shot_lock:
+            encoders = pyBPE._one_shot_encoders
+            encoders[key] = encoder
+            while len(encoders) > ONE_SHOT_ENCODERS:
+                encoders.popitem(last=False)
+        return encoder
+
+    @staticmethod
+    def apply_bpe_to_file(input_path: Text, output_path: Text,
+                          codes_path: Text, vocab_path: Text = None) -> None:
+        # as `fast applybpe`, streamed when the input is not a regular file
+        bpe.apply_bpe_file(output_path, input_path, codes_path,
+                           vocab_path or "")
+
+    @staticmethod
+    def compile_model(codes_path: Text, vocab_path: Text,
+                      output_path: Text) -> None:
+        # binary model, usable as `codes_path` (without vocab_path)
+        # and mapped in place instead of being parsed
+        bpe.compile_model(codes_path, vocab_path or "", output_path)
+
+    @staticmethod
+    def compile_model_fd(codes_path: Text, vocab_path: Text = None) -> int:
+        """Compiles a model into a sealed in-memory file and returns its
+        descriptor, to be opened with `open_model` in this process or in
+        forked (or descriptor-passing) worker processes."""
+        return bpe.compile_model_fd(codes_path, vocab_path or "")
+
+    @staticmethod
+    def open_model(model, cache_size: int = 65536) -> 'pyBPE':
+        """Opens a compiled model from its path or from a file descriptor.
+        The model is mapped read-only and used in place: processes opening
+        the same model share its memory."""
+        if isinstance(model, int):
+            loaded = pyBPE(cache_size=cache_size)
+            loaded.encoder = bpe.open_model_fd(model, cache_size)
+        else:
+            loaded = pyBPE(codes_path=model, cache_size=cache_size)
+            loaded.load()
+        return loaded
+
+    @staticmethod
+    def set_num_threads(n_threads: int,
+                        inline_threshold: int = None) -> None:
+        # size of the C++ worker pool, and the number of words
+        # below which encoding stays on the calling thread
+        bpe.set_num_threads(n_threads)
+        if inline_threshold is not None:
+            bpe.set_inline_threshold(inline_threshold)
+
+    @staticmethod
+    def get_num_threads() -> int:
+        return bpe.get_num_threads()
+
+    @staticmethod
+    def get_inline_threshold() -> int:
+        return bpe.get_inline_threshold()
+
+    @staticmethod
+    def scan_kernel() -> Text:
+        # "scalar", "sse2" or "avx2", the best supported or $PYBPE_SIMD
+        return bpe.scan_kernel()
+
+    @staticmethod
+    def enable_stats(enabled: bool = True) -> None:
+        # process-wide counters and timers of the encoder and learner,
+        # off by default (or on with $PYBPE_STATS=1)
+        bpe.set_stats_enabled(enabled)
+
+    @staticmethod
+    def stats() -> Dict:
+        return bpe.get_stats()
+
+    @staticmethod
+    def reset_stats() -> None:
+        bpe.reset_stats()
+
     @staticmethod
     def create_vocab_file(text: Text, output_path: Text) -> None:
         vocab = pyBPE._learn_vocab(text)
@@ -69,6 +253,17 @@ class pyBPE:
         codes = pyBPE._learn_bpe_codes(text, n_codes)
         pyBPE._write_codes_file(codes, output_path)
 
+    @staticmethod
+    def get_vocab_from_files(paths: List[Text]) -> Dict[Text, int]:
+        # word counts of text files, counted on the thread pool
+        return bpe.get_vocab_files(paths)
+
+    @staticmethod
+    def learn_bpe_from_files(paths: List[Text],
+                             n_codes: int) -> List[Tuple[Text, Text, int]]:
+        # codes learned from text files or vocabulary shards
+        return bpe.learn_bpe_files(n_codes, paths)
+
     def _learn_vocab(text: Text) -> List[Tuple[Text, int]]:
         try:
             return bpe.get_vocabs(text)
@@ -1,5 +1,6 @@
 import pytest
 import os
+import random
 
 from pybpe import pyBPE
 
@@ -38,3 +39,38 @@ def output():
 @pytest.fixture
 def BPE():
     return pyBPE
+
+
+@pytest.fixture(scope="session")
+def corpus_text():
+    """About 1.5MB of Zipf distributed words made of 1 to 4 bytes UTF-8
+    chars, so that chars straddle the 64 bytes scanning blocks, with runs
+    of separators and no separator after the last word."""
+    rng = random.Random(1234)
+    chars = "abcdefghij" + "\u00e9\u00df\u0436\u044f" + "\u4e2d\u6587" + \
+        "\U0001f600"
+    words = ["".join(rng.choice(chars) for _ in range(rng.randint(1, 12)))
+             for _ in range(5000)]
+    parts = []
+    size = 0
+    while size < 3 << 19:
+        word = words[int(len(words) ** rng.random()) - 1]
+        sep = rng.choice([" ", " ", " ", "\n", "  ", " \n"])
+        parts.append(word + sep)
+        size += len(word.encode()) + len(sep)
+    parts.append(words[0])
+    return "".join(parts)
+
+
+@pytest.fixture
+def set_threads(BPE):
+    """Sets the size of the C++ thread pool, every loop running on it, and
+    restores the size and inline threshold it had afterwards."""
+    n_threads = BPE.get_num_threads()
+    inline_threshold = BPE.get_inline_threshold()
+
+    def set_threads(n):
+        BPE.set_num_threads(n, inline_threshold=1)
+
+    yield set_threads
+    BPE.set_num_threads(n_threads, inline_threshold=inline_threshold)
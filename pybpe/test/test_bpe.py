@@ -1,6 +1,14 @@
 import pytest
 import os
+import re
+import sys
+import json
 import time
+import subprocess
+
+from collections import Counter
+
+from concurrent.futures import ThreadPoolExecutor
 
 
 @pytest.mark.parametrize('vocab_file', ['/tmp/vocab'])
@@ -32,6 +40,162 @@ def test_vocab(BPE, train_text, vocab, vocab_file):
     assert t_vocab == vocab
 
 
+@pytest.mark.parametrize('n_threads', [1, 2, 4])
+def test_vocab_from_files(BPE, corpus_text, tmp_path, set_threads, n_threads):
+    path = tmp_path / "corpus"
+    path.write_bytes(corpus_text.encode())
+    # the last word is not counted without a separator after it
+    words = re.split("[ \n]", corpus_text)
+    expected = Counter(word for word in words[:-1] if word)
+
+    set_threads(n_threads)
+    assert BPE.get_vocab_from_files([str(path)]) == expected
+    path.write_bytes((corpus_text + "\n").encode())
+    expected[words[-1]] += 1
+    assert BPE.get_vocab_from_files([str(path)]) == expected
+
+
+@pytest.mark.parametrize('n_threads', [2, 4])
+def test_learn_bpe_from_files(BPE, corpus_text, tmp_path, set_threads,
+                              n_threads):
+    path = str(tmp_path / "corpus")
+    with open(path, "wb") as f:
+        f.write(corpus_text.encode())
+    set_threads(1)
+    expected = BPE.learn_bpe_from_files([path], 500)
+    assert len(expected) == 500
+    # every merge touching more than one word runs on the pool
+    set_threads(n_threads)
+    assert BPE.learn_bpe_from_files([path], 500) == expected
+
+
+# counts, codes and BPE of argv[1], printed as JSON / written to argv[2]
+SCAN_SCRIPT = """
+import json, sys
+from pybpe import pyBPE
+corpus, output = sys.argv[1:]
+pyBPE.set_num_threads(2, inline_threshold=1)
+codes = pyBPE.learn_bpe_from_files([corpus], 200)
+pyBPE._write_codes_file(codes, output + ".codes")
+pyBPE.apply_bpe_to_file(corpus, output, output + ".codes")
+print(json.dumps([pyBPE.scan_kernel(), pyBPE.get_vocab_from_files([corpus]),
+                  [list(code) for code in codes]]))
+"""
+
+
+@pytest.mark.parametrize('kernel', ['scalar', 'sse2', 'avx2'])
+def test_scan_kernels(BPE, corpus_text, tmp_path, kernel):
+    corpus, output, expected = (str(tmp_path / name)
+                                for name in ["corpus", "output", "expected"])
+    with open(corpus, "wb") as f:
+        f.write(corpus_text.encode())
+    env = dict(os.environ, PYBPE_SIMD=kernel,
+               PYTHONPATH=os.pathsep.join(sys.path))
+    run = subprocess.run([sys.executable, "-c", SCAN_SCRIPT, corpus, output],
+                         env=env, stdout=subprocess.PIPE, check=True)
+    used, vocab, codes = json.loads(run.stdout.decode())
+    if used != kernel:
+        pytest.skip("{} is not supported".format(kernel))
+
+    # as the default kernel of this process
+    assert vocab == BPE.get_vocab_from_files([corpus])
+    assert [tuple(code) for code in codes] == \
+        BPE.learn_bpe_from_files([corpus], 200)
+    BPE.apply_bpe_to_file(corpus, expected, output + ".codes")
+    with open(output, "rb") as f, open(expected, "rb") as g:
+        assert f.read() == g.read()
+
+
+@pytest.mark.parametrize('n_threads', [1, 2, 4])
+@pytest.mark.parametrize('newlines', [True, False])
+def test_apply_bpe_to_file(BPE, corpus_text, tmp_path, set_threads, n_threads,
+                           newlines):
+    # several 8MB output chunks, cut inside lines without new lines
+    text = corpus_text * 6
+    if not newlines:
+        text = text.replace("\n", " ")
+    corpus, codes, output = (str(tmp_path / name)
+                             for name in ["corpus", "codes", "output"])
+    with open(corpus, "wb") as f:
+        f.write(text.encode())
+    BPE._write_codes_file(BPE.learn_bpe_from_files([corpus], 200), codes)
+
+    set_threads(n_threads)
+    BPE.apply_bpe_to_file(corpus, output, codes)
+    with open(output, "rb") as f:
+        result = f.read().decode()
+    # as the encoder, up to the last separator (encode adds a new line)
+    cut = max(text.rfind(" "), text.rfind("\n")) + 1
+    expected = BPE(codes_path=codes)
+    expected.load()
+    assert result == expected.apply_bpe(text[:cut])[:-1]
+
+
+@pytest.mark.parametrize('n_threads', [2, 4])
+def test_apply_bpe_vocab(BPE, corpus_text, tmp_path, set_threads, n_threads):
+    corpus, codes, vocab, model, output = (
+        str(tmp_path / name)
+        for name in ["corpus", "codes", "vocab", "model", "output"])
+    with open(corpus, "wb") as f:
+        f.write(corpus_text.encode())
+    BPE._write_codes_file(BPE.learn_bpe_from_files([corpus], 200), codes)
+    # tokens frequent in half of the corpus: the other half needs limiting
+    full = BPE(codes_path=codes)
+    full.load()
+    tokens = Counter(full.apply_bpe(corpus_text[:len(corpus_text) // 2])
+                     .split())
+    BPE._write_vocab_file({t: c for t, c in tokens.items() if c >= 5}, vocab)
+    BPE.compile_model(codes, vocab, model)
+    lines = corpus_text.split("\n")
+
+    def apply_all():
+        BPE.apply_bpe_to_file(corpus, output, codes, vocab)
+        with open(output, "rb") as f:
+            applied = f.read()
+        limited = BPE(codes_path=codes, vocab_path=vocab)
+        limited.load()
+        return (applied, limited.apply_bpe_batch(lines),
+                BPE.open_model(model).apply_bpe_batch(lines))
+
+    set_threads(1)
+    expected = apply_all()
+    assert expected[1] != full.apply_bpe_batch(lines)
+    assert expected[2] == expected[1]
+    set_threads(n_threads)
+    assert apply_all() == expected
+
+
+@pytest.mark.parametrize('n_threads', [1, 2, 4])
+@pytest.mark.parametrize('newlines', [True, False])
+def test_apply_bpe_stream(BPE, corpus_text, tmp_path, set_threads, n_threads,
+                          newlines):
+    text = corpus_text if newlines else corpus_text.replace("\n", " ")
+    data = text.encode()
+    corpus, fifo, codes, output, streamed = (
+        str(tmp_path / name)
+        for name in ["corpus", "fifo", "codes", "output", "streamed"])
+    with open(corpus, "wb") as f:
+        f.write(data)
+    BPE._write_codes_file(BPE.learn_bpe_from_files([corpus], 200), codes)
+
+    set_threads(n_threads)
+    BPE.apply_bpe_to_file(corpus, output, codes)
+
+    # a pipe, written in odd sized pieces, is read as a stream
+    def write_fifo():
+        with open(fifo, "wb") as f:
+            for i in range(0, len(data), 100003):
+                f.write(data[i:i + 100003])
+
+    os.mkfifo(fifo)
+    with ThreadPoolExecutor(1) as executor:
+        writer = executor.submit(write_fifo)
+        BPE.apply_bpe_to_file(fifo, streamed, codes)
+        writer.result()
+    with open(output, "rb") as f, open(streamed, "rb") as g:
+        assert f.read() == g.read()
+
+
 @pytest.mark.parametrize('code_file,n_codes', [('/tmp/codes', 10)])
 def test_learn_bpe(BPE, train_text, codes, code_file, n_codes):
     BPE.create_bpe_file(train_text, n_codes, code_file)
@@ -59,6 +223,31 @@ def test_bpe_from_python(BPE, output, test_text, vocab_file, codes_file):
     assert res_f == output
 
 
+@pytest.mark.parametrize('vocab_file,codes_file', [
+    ('/tmp/vocab', '/tmp/codes')
+])
+def test_bpe_from_files_reuse(BPE, output, test_text, vocab_file, codes_file,
+                              tmp_path):
+    codes = str(tmp_path / "codes")
+    with open(codes_file) as f:
+        lines = f.readlines()
+    with open(codes, "w") as f:
+        f.writelines(lines)
+    assert BPE.apply_bpe_from_files(test_text, codes, vocab_file) == output
+    # one-shot calls share an encoder until the files change
+    encoder = BPE._one_shot_encoder(codes, vocab_file)
+    assert BPE.apply_bpe_from_files(test_text, codes, vocab_file) == output
+    assert BPE._one_shot_encoder(codes, vocab_file) is encoder
+
+    with open(codes, "w") as f:
+        f.writelines(lines[:2])
+    assert BPE._one_shot_encoder(codes, vocab_file) is not encoder
+    expected = BPE(vocab_path=vocab_file, codes_path=codes)
+    expected.load()
+    assert BPE.apply_bpe_from_files(test_text, codes, vocab_file) == \
+        expected.apply_bpe(test_text) != output
+
+
 @pytest.mark.parametrize('vocab_file,codes_file', [
     ('/tmp/vocab', '/tmp/codes')
 ])
@@ -85,3 +274,339 @@ def test_file_vs_mem_time(BPE, output, test_text, vocab_file, codes_file):
     print("Time from-file: {:.4f} | from-mem: {:.4f}".format(f_time, m_time))
     assert f_time > m_time
 
+
+
+@pytest.mark.parametrize('vocab_file,codes_file', [
+    ('/tmp/vocab', '/tmp/codes')
+])
+def test_encoder_reuse(BPE, output, test_text, vocab_file, codes_file):
+    bpe = BPE(vocab_path=vocab_file, codes_path=codes_file)
+    bpe.load()
+    assert bpe.encoder.num_codes() > 0
+    # the loaded encoder is reused across calls
+    for _ in range(10):
+        assert bpe.apply_bpe(test_text) == output
+
+
+@pytest.mark.parametrize('vocab_file,codes_file', [
+    ('/tmp/vocab', '/tmp/codes')
+])
+def test_encoder_cache(BPE, output, test_text, vocab_file, codes_file):
+    bpe = BPE(vocab_path=vocab_file, codes_path=codes_file, cache_size=1000)
+    bpe.load(warmup=100)
+    stats = bpe.cache_stats()
+    # every vocab word is pre-warmed
+    assert stats["size"] == 6
+    assert stats["capacity"] == 1000
+
+    assert bpe.apply_bpe(test_text) == output
+    stats = bpe.cache_stats()
+    # only 'this' and 'is' were pre-warmed
+    assert stats["hits"] == 2
+    assert stats["misses"] == 3
+    assert stats["size"] == 9
+
+    assert bpe.apply_bpe(test_text) == output
+    assert bpe.cache_stats()["hits"] >= 3
+
+
+@pytest.mark.parametrize('vocab_file,codes_file', [
+    ('/tmp/vocab', '/tmp/codes')
+])
+def test_cache_resize_while_encoding(BPE, corpus_text, vocab_file,
+                                     codes_file):
+    bpe = BPE(vocab_path=vocab_file, codes_path=codes_file, cache_size=0)
+    bpe.load()
+    texts = corpus_text.split("\n")[:20000]
+    expected = bpe.apply_bpe_batch(texts)
+    with ThreadPoolExecutor(max_workers=4) as executor:
+        futures = [executor.submit(bpe.apply_bpe_batch, texts)
+                   for _ in range(8)]
+        # shard counts change with the capacity, under running lookups
+        for size in [1000, 3, 50000, 1, 16, 7] * 4:
+            bpe.encoder.set_cache_size(size)
+            assert bpe.cache_stats()["size"] <= size
+        for future in futures:
+            assert future.result() == expected
+    # no entry is left behind in a shard that is not used any more
+    for size in [5, 0]:
+        bpe.encoder.set_cache_size(size)
+        assert bpe.apply_bpe_batch(texts) == expected
+        assert bpe.cache_stats()["size"] <= size
+
+
+@pytest.mark.parametrize('vocab_file,codes_file', [
+    ('/tmp/vocab', '/tmp/codes')
+])
+def test_thread_pool(BPE, output, test_text, vocab_file, codes_file,
+                     set_threads):
+    bpe = BPE(vocab_path=vocab_file, codes_path=codes_file, cache_size=0)
+    bpe.load()
+    # force the pool to be used even for a handful of words
+    set_threads(4)
+    assert BPE.get_num_threads() == 4 and BPE.get_inline_threshold() == 1
+    assert bpe.apply_bpe(test_text) == output
+    set_threads(1)
+    assert bpe.apply_bpe(test_text) == output
+
+
+@pytest.mark.parametrize('vocab_file,codes_file', [
+    ('/tmp/vocab', '/tmp/codes')
+])
+def test_resize_while_encoding(BPE, output, test_text, vocab_file, codes_file,
+                               set_threads):
+    bpe = BPE(vocab_path=vocab_file, codes_path=codes_file, cache_size=0)
+    bpe.load()
+    texts = [test_text] * 200
+    set_threads(4)
+    with ThreadPoolExecutor(max_workers=4) as executor:
+        futures = [executor.submit(bpe.apply_bpe_batch, texts)
+                   for _ in range(16)]
+        # resizing waits for the running loops instead of breaking them
+        for n in [1, 3, 2, 4] * 4:
+            BPE.set_num_threads(n)
+        for future in futures:
+            assert future.result() == [output] * len(texts)
+
+
+@pytest.mark.parametrize('vocab_file,codes_file', [
+    ('/tmp/vocab', '/tmp/codes')
+])
+def test_fork_while_encoding(BPE, output, test_text, vocab_file, codes_file,
+                             set_threads):
+    # without a cache, only the pool is shared with the encoding thread
+    bpe = BPE(vocab_path=vocab_file, codes_path=codes_file, cache_size=0)
+    bpe.load()
+    texts = [test_text] * 200
+    set_threads(4)
+
+    # encodes, restarting the pool (under its locks) between batches
+    def encode():
+        results = []
+        for i in range(200):
+            BPE.set_num_threads(2 + i % 3)
+            results.append(bpe.apply_bpe_batch(texts))
+        return results
+
+    with ThreadPoolExecutor(max_workers=1) as executor:
+        future = executor.submit(encode)
+        for _ in range(50):
+            pid = os.fork()
+            if pid == 0:
+                # the child encodes on a pool of its own
+                ok = bpe.apply_bpe_batch(texts) == [output] * len(texts)
+                os._exit(0 if ok else 1)
+            deadline = time.time() + 30
+            while True:
+                done, status = os.waitpid(pid, os.WNOHANG)
+                if done != 0:
+                    break
+                if time.time() > deadline:
+                    os.kill(pid, 9)
+                    os.waitpid(pid, 0)
+                    pytest.fail("the forked child is stuck")
+                time.sleep(0.01)
+            assert os.WIFEXITED(status) and os.WEXITSTATUS(status) == 0
+        assert all(res == [output] * len(texts) for res in future.result())
+
+
+@pytest.mark.parametrize('vocab_file,codes_file', [
+    ('/tmp/vocab', '/tmp/codes')
+])
+def test_bpe_batch(BPE, output, test_text, vocab_file, codes_file):
+    bpe = BPE(vocab_path=vocab_file, codes_path=codes_file)
+    bpe.load()
+    texts = [test_text, "", test_text + " " + test_text, "sample"]
+    res = bpe.apply_bpe_batch(texts)
+    assert res == [bpe.apply_bpe(t) for t in texts]
+    assert res[0] == output
+
+    # the GIL is released while encoding
+    with ThreadPoolExecutor(max_workers=4) as executor:
+        res = list(executor.map(bpe.apply_bpe, [test_text] * 100))
+    assert res == [output] * 100
+
+
+@pytest.mark.parametrize('vocab_file,codes_file', [
+    ('/tmp/vocab', '/tmp/codes')
+])
+def test_bpe_ids(BPE, test_text, vocab_file, codes_file):
+    bpe = BPE(vocab_path=vocab_file, codes_path=codes_file)
+    bpe.load()
+    texts = [test_text, "test sample", ""]
+    ids, offsets = bpe.apply_bpe_ids(texts)
+    assert ids.format == "i" and offsets.format == "q"
+    assert list(offsets)[0] == 0 and len(offsets) == len(texts) + 1
+
+    table = bpe.token_table()
+    # vocab entries come first, in file order
+    with open(vocab_file, 'r') as f:
+        vocab = [line.split()[0] for line in f]
+    assert table[:len(vocab)] == vocab
+
+    for i, text in enumerate(texts):
+        tokens = bpe.apply_bpe(text).split()
+        text_ids = ids[offsets[i]:offsets[i + 1]]
+        assert len(text_ids) == len(tokens)
+        for token, token_id in zip(tokens, text_ids):
+            assert token_id == bpe.unk_id() or table[token_id] == token
+
+    # unknown tokens get a real id past the table, or the one given
+    assert bpe.unk_id() == len(table) and min(ids) >= 0
+    assert bpe.unk_id() in list(ids)
+    assert bpe.encoder.token_id("not a token") == len(table)
+    bpe.set_unk_id(0)
+    assert list(bpe.apply_bpe_ids(texts)[0]) == \
+        [0 if i == len(table) else i for i in ids]
+    with pytest.raises(ValueError):
+        bpe.set_unk_id(-1)
+
+
+@pytest.mark.parametrize('vocab_file,codes_file', [
+    ('/tmp/vocab', '/tmp/codes')
+])
+def test_bpe_ids_hash(BPE, vocab_file, codes_file):
+    bpe = BPE(vocab_path=vocab_file, codes_path=codes_file)
+    bpe.load()
+    # the low 32 bits of the hash of this word are all set, interning it
+    # and then growing the index must keep it
+    word = b"wVd&s>\\f;X-@p`Np".decode()
+    text = " ".join([word] + ["w{}".format(i) for i in range(100)])
+    ids, offsets = bpe.apply_bpe_ids([text])
+    assert len(ids) == len(bpe.apply_bpe(text).split())
+
+
+@pytest.mark.parametrize('vocab_file,codes_file', [
+    ('/tmp/vocab', '/tmp/codes')
+])
+def test_stats(BPE, test_text, vocab_file, codes_file, capfd):
+    bpe = BPE(vocab_path=vocab_file, codes_path=codes_file)
+    bpe.load()
+    BPE.enable_stats()
+    BPE.reset_stats()
+    bpe.apply_bpe(test_text)
+    stats = BPE.stats()
+    assert stats["words"] == len(test_text.split())
+    assert stats["bytes_in"] > 0 and stats["bytes_out"] >= stats["bytes_in"]
+    assert stats["cache_hits"] + stats["cache_misses"] > 0
+
+    # learning reports its peak pair table and memory in the stats only
+    capfd.readouterr()
+    BPE._learn_bpe_codes(test_text, 5)
+    assert "Learned" not in capfd.readouterr().err
+    stats = BPE.stats()
+    assert stats["learn_merges"] > 0 and len(stats["learn_merge_ns"]) > 0
+    assert stats["peak_pairs"] > 0 and stats["peak_memory_kb"] > 0
+
+    BPE.reset_stats()
+    BPE.enable_stats(False)
+    bpe.apply_bpe(test_text)
+    assert BPE.stats()["words"] == 0
+
+
+@pytest.mark.parametrize('vocab_file,codes_file', [
+    ('/tmp/vocab', '/tmp/codes')
+])
+def test_decode(BPE, test_text, vocab_file, codes_file):
+    bpe = BPE(vocab_path=vocab_file, codes_path=codes_file)
+    bpe.load()
+    texts = [test_text, "test sample", ""]
+    encoded = bpe.apply_bpe_batch(texts)
+    # encoding ends texts with a new line
+    assert BPE.decode_batch(encoded) == [text + "\n" for text in texts]
+    assert BPE.decode(encoded[0]) == test_text + "\n"
+    assert BPE.decode("a@@ b@@\nc@@") == "ab\nc"
+    assert BPE.decode("a@@@ b @@x") == "a@b @@x"
+
+    # ids decode to the words, separated by a space (chars missing from
+    # the token table, as 'x' in 'example', are lost)
+    texts = ["this  is a\nsimple test", "test sample", ""]
+    ids, offsets = bpe.apply_bpe_ids(texts)
+    expected = [" ".join(text.split()) for text in texts]
+    assert bpe.decode_ids(ids, offsets) == expected
+    assert bpe.decode_ids(list(ids), list(offsets)) == expected
+    assert bpe.decode_ids(ids[offsets[1]:offsets[2]]) == expected[1]
+    # the unk id decodes to nothing, other ids outside the table raise
+    assert bpe.decode_ids([bpe.unk_id()]) == ""
+    for bad_id in [-1, bpe.unk_id() + 1]:
+        with pytest.raises(IndexError):
+            bpe.decode_ids([bad_id])
+
+
+@pytest.mark.parametrize('vocab_file,codes_file', [
+    ('/tmp/vocab', '/tmp/codes')
+])
+def test_bpe_offsets(BPE, test_text, vocab_file, codes_file):
+    bpe = BPE(vocab_path=vocab_file, codes_path=codes_file)
+    bpe.load()
+    texts = [test_text, "  test\nsample é", ""]
+    ids, starts, ends, offsets = bpe.apply_bpe_offsets(texts)
+    assert starts.format == "q" and ends.format == "q"
+    assert list(ids) == list(bpe.apply_bpe_ids(texts)[0])
+    assert len(starts) == len(ends) == len(ids)
+
+    for i, text in enumerate(texts):
+        data = text.encode()
+        tokens = bpe.apply_bpe(text).split()
+        spans = list(zip(starts, ends))[offsets[i]:offsets[i + 1]]
+        assert len(spans) == len(tokens)
+        for token, (start, end) in zip(tokens, spans):
+            assert data[start:end].decode() == token.replace("@@", "")
+
+    # triples of one encoding, unknown tokens (é) keeping their string
+    text = "test sample \u00e9t\u00e9"
+    BPE.enable_stats()
+    BPE.reset_stats()
+    spans = bpe.apply_bpe_spans(text)
+    assert BPE.stats()["words"] == 3
+    BPE.enable_stats(False)
+    assert [t for t, _, _ in spans] == bpe.apply_bpe(text).split()
+    data = text.encode()
+    assert b"".join(data[s:e] for _, s, e in spans).decode() == \
+        "testsample\u00e9t\u00e9"
+
+
+@pytest.mark.parametrize('vocab_file,codes_file,model_file', [
+    ('/tmp/vocab', '/tmp/codes', '/tmp/model')
+])
+def test_compiled_model(BPE, test_text, vocab_file, codes_file, model_file):
+    bpe = BPE(vocab_path=vocab_file, codes_path=codes_file)
+    bpe.load()
+
+    BPE.compile_model(codes_file, vocab_file, model_file)
+    compiled = BPE(codes_path=model_file)
+    compiled.load()
+    assert compiled.encoder is not None
+
+    texts = [test_text, "test sample", ""]
+    assert compiled.apply_bpe_batch(texts) == bpe.apply_bpe_batch(texts)
+    assert compiled.token_table() == bpe.token_table()
+    ids, offsets = compiled.apply_bpe_ids(texts)
+    ref_ids, ref_offsets = bpe.apply_bpe_ids(texts)
+    assert list(ids) == list(ref_ids) and list(offsets) == list(ref_offsets)
+
+
+@pytest.mark.parametrize('vocab_file,codes_file', [
+    ('/tmp/vocab', '/tmp/codes')
+])
+def test_shared_model(BPE, test_text, vocab_file, codes_file):
+    bpe = BPE(vocab_path=vocab_file, codes_path=codes_file)
+    bpe.load()
+    expected = bpe.apply_bpe(test_text)
+
+    fd = BPE.compile_model_fd(codes_file, vocab_file)
+    shared = BPE.open_model(fd)
+    assert shared.apply_bpe(test_text) == expected
+
+    # forked workers use the model mapped by their parent
+    read_end, write_end = os.pipe()
+    pid = os.fork()
+    if pid == 0:
+        os.close(read_end)
+        os.write(write_end, shared.apply_bpe(test_text).encode())
+        os._exit(0)
+    os.close(write_end)
+    with os.fdopen(read_end) as f:
+        assert f.read() == expected
+    os.waitpid(pid, 0)
+    os.close(fd)